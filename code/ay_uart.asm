@@ -2,16 +2,22 @@
 ;; Based on proven SnapZX/BridgeZX code
 ;; TX: Port A bit 3
 ;; RX: Port A bit 7
-;; Baud: 9600
+;; Baud: 9600 at init, 19200 via ay_uart_set_baud
 
     SECTION code_user
 
     PUBLIC _ay_uart_init
+    PUBLIC _ay_uart_set_baud
+    PUBLIC _ay_uart_hold
     PUBLIC _ay_uart_send
     PUBLIC _ay_uart_send_block
     PUBLIC _ay_uart_read
+    PUBLIC _ay_uart_read_burst
+    PUBLIC _ay_uart_read_data
+    PUBLIC _ay_uart_edit
     PUBLIC _ay_uart_ready
     PUBLIC _ay_uart_ready_fast
+    PUBLIC _ay_uart_ferr
 
 ;; ============================================================
 ;; DATA SEQUENCE FOR SPEED INITIALIZATION
@@ -56,9 +62,15 @@ defc dataSize = dataSequenceEnd - dataSequence
 
     SECTION bss_user
 
-_baud:              defs 2      ; Baud rate delay value (11 for 9600)
+_baud:              defs 2      ; Baud rate delay value (11 for 9600, 4 for 19200)
+_ay_uart_ferr:      defs 2      ; Framing errors (stop bit low) since init
 _isSecondByteAvail: defs 1      ; Second byte available flag  
 _secondByte:        defs 1      ; Cached second byte
+_uartHold:          defs 1      ; 1 = keep CTS high (receiver busy)
+burstPort:          defs 1      ; PORT A value with CTS low (burst read)
+burstIdle:          defs 2      ; Idle poll count ~ one character time
+burstStall:         defs 1      ; Idle windows left before giving up (0 = burst)
+_ay_uart_edit:      defs 1      ; 1 = ay_uart_read_data stopped on EDIT
 
     SECTION code_user
 
@@ -115,25 +127,82 @@ _ay_uart_init:
     
     ei
     
-    ; Wait for ESP to stabilize (shorter)
-    ld b, 50
-initFlush:
-    halt
-    djnz initFlush
+    ; No settle delay here: smart_init only waits if the ESP does not answer
     
     ; Set baud rate
     ld hl, 11               ; 9600 baud
     ld (_baud), hl
     
-    ; Clear second byte cache
+    ; Clear second byte cache, hold flag and error counter
     xor a
     ld (_isSecondByteAvail), a
+    ld (_uartHold), a
+    ld h, a
+    ld l, a
+    ld (_ay_uart_ferr), hl
     
     ; Send speed initialization sequence
     call setSpeed
     
     ret
 
+;; ============================================================
+;; ay_uart_set_baud - Change bit delay (fastcall: delay in HL)
+;; Both ends must be switched together (see AT+UART_CUR in C)
+;; RX bit = ~84 + 26*delay T-states, TX bit = ~141 + 26*(delay-2)
+;; ============================================================
+_ay_uart_set_baud:
+    ld (_baud), hl
+    ret
+
+;; ============================================================
+;; ay_uart_hold - Back-pressure (fastcall: L = 1 hold, 0 release)
+;; Hold raises CTS now and keeps it high: read, burst and ready
+;; probes stop lowering it, so the ESP only finishes the byte in
+;; flight. Release lowers CTS again.
+;; ============================================================
+_ay_uart_hold:
+    ld a, l
+    ld (_uartHold), a
+    ld bc, 0xFFFD
+    ld a, 0x0E
+    out (c), a              ; Select AY's PORT A
+    ld b, 0xBF
+    in a, (c)
+    or 0xF0                 ; Input lines to 1
+    and 0xFB                ; CTS low
+    call ctsApplyHold
+    out (c), a
+    ret
+
+;; ctsApplyHold - A = PORT A value with CTS low; sets CTS if held
+ctsApplyHold:
+    push hl
+    ld hl, _uartHold
+    bit 0, (hl)
+    pop hl
+    ret z
+    or 0x04
+    ret
+
+;; ctsOpen - Lower CTS unless held (A = PORT A read, BC = 0xBFFD)
+;; A is preserved for the caller's RX test
+ctsOpen:
+    push af
+    ld a, (_uartHold)
+    or a
+    jr nz, ctsOpenDone
+    pop af
+    push af
+    bit 2, a
+    jr z, ctsOpenDone       ; Already low
+    or 0xF0
+    and 0xFB
+    out (c), a
+ctsOpenDone:
+    pop af
+    ret
+
 ;; ============================================================
 ;; ay_uart_send - Send a byte (fastcall: byte in L)
 ;; ============================================================
@@ -260,6 +329,8 @@ sendBlockLoop:
     push hl                 ; Save buffer pointer
     
     ld a, (hl)              ; Get byte to send
+    push ix
+    pop de                  ; DE = baud - 2 (bit loop copies it like ay_uart_send)
     
     ; === Core transmit (optimized) ===
     cpl                     ; Complement byte
@@ -271,8 +342,8 @@ sendBlockBit:
     push af
     
     ld a, 0xFE
-    push ix
-    pop hl                  ; HL = baud - 2 (from IX)
+    ld h, d
+    ld l, e                 ; HL = baud - 2 (same bit timing as ay_uart_send)
     ld bc, 0xBFFD
     jp nc, sendBlockOne
     
@@ -341,6 +412,7 @@ checkPortReady:
     ; Read port
     ld b, 0xBF
     in a, (c)
+    call ctsOpen            ; Let the ESP send unless held
     
     ; RX is bit 7, start bit = 0
     and 0x80
@@ -372,6 +444,7 @@ checkPortReadyFast:
     ; Read port directly
     ld bc, 0xBFFD
     in a, (c)
+    call ctsOpen            ; Let the ESP send unless held
     
     ; RX is bit 7, start bit = 0
     and 0x80
@@ -423,6 +496,7 @@ startReadByte:
     in a, (c)
     or 0xF0                 ; Input lines to 1
     and 0xFB                ; CTS force to 0
+    call ctsApplyHold       ; ...unless held
     ld b, e
     out (c), a              ; Update port
     ld h, a                 ; Save port state
@@ -511,14 +585,28 @@ readFinish:
     ld bc, 0x0007
     or a
     sbc hl, bc
+    jr z, stopBitCheck      ; delay 7: already mid stop bit
+    jr nc, delayForStopBit
+    ld hl, 0                ; Fast profiles: overhead alone reaches the stop bit
+    jr stopBitCheck
 
 delayForStopBit:
     dec hl
     ld a, h
     or l
     jr nz, delayForStopBit
-    
+
+stopBitCheck:
     ld bc, 0xFFFD
+    in a, (c)
+    and 0x80                ; Stop bit must be 1
+    jr nz, stopBitOk
+    ld hl, (_ay_uart_ferr)
+    inc hl
+    ld (_ay_uart_ferr), hl
+    ld hl, 0
+
+stopBitOk:
     add hl, de
     add hl, de
     add hl, de
@@ -598,3 +686,274 @@ secondByteFinished:
     ld l, a
     ei
     ret
+
+;; ============================================================
+;; ay_uart_read_data - Fused receive of data-link payload
+;; C prototype: uint16_t ay_uart_read_data(void *dst, uint16_t max) __z88dk_callee;
+;; Called with max = payload left in the current +IPD (capped by the free
+;; span of the ring), so payload bytes skip the demux and are written to SD
+;; from where they land. Same loop as ay_uart_read_burst with the +IPD
+;; counted down in BC', but an idle line does not end it: the ESP sends a
+;; +IPD back to back, so it only stops when max is reached (end of the
+;; +IPD or of the ring span) or on EDIT. EDIT (CAPS SHIFT + 1) is sampled
+;; before the DI window and after each idle character time. After
+;; DATA_STALL idle windows in one call the ESP is taken as stalled and the
+;; bytes so far are returned, so callers can still run their deadlines.
+;; Output: HL = bytes stored, _ay_uart_edit = 1 if it stopped on EDIT
+;; ============================================================
+defc DATA_STALL = 32
+
+_ay_uart_read_data:
+    xor a
+    ld (_ay_uart_edit), a
+    call burstEditDown
+    jr c, readDataGo
+    
+    ld a, 1
+    ld (_ay_uart_edit), a
+    pop bc                  ; BC = return address
+    pop de                  ; Drop max
+    pop de                  ; Drop dst
+    push bc
+    ld hl, 0
+    ret
+
+readDataGo:
+    ld a, DATA_STALL
+    jr burstEntry
+
+;; EDIT (CAPS SHIFT + 1) test. Output: NC if down. Destroys A, BC, L.
+burstEditDown:
+    ld bc, 0xFEFE
+    in a, (c)               ; CAPS SHIFT in bit 0 (0 = down)
+    ld l, a
+    ld b, 0xF7
+    in a, (c)               ; '1' in bit 0
+    or l
+    rra
+    ret
+
+;; ============================================================
+;; ay_uart_read_burst - Receive back-to-back bytes into a buffer
+;; C prototype: uint16_t ay_uart_read_burst(void *dst, uint16_t max) __z88dk_callee;
+;; Stack (sccz80 pushes left to right): [ret addr][max][dst]
+;; Stays in one DI window and stores bytes until max is reached or the
+;; line has been idle for about one character time.
+;; CTS goes high with one slot left so a byte already in flight still fits.
+;; Output: HL = bytes stored
+;; ============================================================
+_ay_uart_read_burst:
+    xor a                   ; Idle line ends the burst
+
+burstEntry:
+    ld (burstStall), a
+    pop bc                  ; BC = return address
+    pop de                  ; DE = max
+    pop hl                  ; HL = dst
+    push bc                 ; Restore return address
+    
+    ld a, d
+    or e
+    jr nz, burstSetup
+    ld h, a
+    ld l, a                 ; max = 0: nothing stored
+    ret
+
+burstSetup:
+    push ix
+    push hl
+    pop ix                  ; IX = destination
+    push de
+    exx
+    pop bc                  ; BC' = slots left
+    ld de, 0                ; DE' = bytes stored
+    exx
+    
+    ; Cached second byte from ay_uart_read goes first
+    ld a, (_isSecondByteAvail)
+    or a
+    jr z, burstOpen
+    xor a
+    ld (_isSecondByteAvail), a
+    ld a, (_secondByte)
+    ld (ix+0), a
+    inc ix
+    exx
+    inc de
+    dec bc
+    ld a, b
+    or c
+    exx
+    jr z, burstExit
+
+burstOpen:
+    di
+    
+    ld bc, 0xFFFD
+    ld a, 0x0E
+    out (c), a              ; Select AY's PORT A
+    in a, (c)
+    or 0xF0                 ; Input lines to 1
+    and 0xFB                ; CTS low: ESP may send
+    call ctsApplyHold       ; ...unless held
+    ld b, 0xBF
+    out (c), a
+    ld (burstPort), a
+    
+    ; Idle window between bytes: 10 bits / ~60 T per poll ~ 4*baud + 16
+    ld hl, (_baud)
+    ld d, h
+    ld e, l                 ; DE = baud (bit delay, kept for the whole burst)
+    add hl, hl
+    add hl, hl
+    ld bc, 0x0010
+    add hl, bc
+    ld (burstIdle), hl
+    ld bc, 0xFFFD           ; BC = port for reads
+    
+    exx
+    ld hl, 0x00FA           ; First start bit: same window as ay_uart_read
+    exx
+
+burstWait:
+    in a, (c)
+    and 0x80
+    jr z, burstStartBit
+    exx
+    dec hl
+    ld a, h
+    or l
+    exx
+    jr nz, burstWait
+    jp burstIdleWin         ; Line idle for one window
+
+burstStartBit:
+    ; Verify start bit (debounce)
+    in a, (c)
+    and 0x80
+    jr nz, burstWait
+    in a, (c)
+    and 0x80
+    jr nz, burstWait
+    
+    ld h, d
+    ld l, e
+    srl h
+    rr l                    ; HL = baud/2 -> first sample at 1.5 bits
+    ld a, 0x80              ; Marker: byte complete when it drops into carry
+    ex af, af'
+
+burstTune:
+    add hl, de
+    nop
+    nop
+    nop
+    nop                     ; Same per-bit timing as readTune
+
+burstDelay:
+    dec hl
+    ld a, h
+    or l
+    jr nz, burstDelay
+    
+    in a, (c)
+    and 0x80
+    jp z, burstZero
+    
+    ; One received:
+    ex af, af'
+    scf
+    rra
+    jr c, burstByte
+    ex af, af'
+    jp burstTune
+
+burstZero:
+    ex af, af'
+    or a
+    rra
+    jr c, burstByte
+    ex af, af'
+    jp burstTune
+
+burstByte:
+    ld (ix+0), a
+    inc ix
+    exx
+    inc de
+    dec bc
+    ld hl, (burstIdle)      ; Fresh idle window for the next byte
+    ld a, b
+    or c
+    exx
+    jr z, burstDone         ; Buffer full
+    
+    ; Wait into the stop bit and check it (bookkeeping above ~0.2-0.4 bits)
+    ld h, d
+    ld l, e
+    srl h
+    rr l
+
+burstStopDelay:
+    dec hl
+    ld a, h
+    or l
+    jr nz, burstStopDelay
+    
+    in a, (c)
+    and 0x80
+    jr nz, burstStopOk
+    ld hl, (_ay_uart_ferr)
+    inc hl
+    ld (_ay_uart_ferr), hl
+
+burstStopOk:
+    exx
+    ld a, c
+    dec a
+    or b                    ; Z if exactly one slot left
+    exx
+    jr nz, burstWait
+    
+    ; Last slot: raise CTS now, keep listening for a byte in flight
+    ld a, (burstPort)
+    or 0x04
+    ld b, 0xBF
+    out (c), a
+    ld b, 0xFF
+    jr burstWait
+
+; Idle window over: ends a burst, ay_uart_read_data keeps waiting
+burstIdleWin:
+    ld a, (burstStall)
+    or a
+    jr z, burstDone
+    dec a
+    ld (burstStall), a
+    jr z, burstDone         ; ESP stalled: let the caller check its deadline
+    call burstEditDown
+    ld bc, 0xFFFD
+    jr nc, burstEdit
+    exx
+    ld hl, (burstIdle)
+    exx
+    jp burstWait
+
+burstEdit:
+    ld a, 1
+    ld (_ay_uart_edit), a   ; Bytes stored so far are still returned
+
+burstDone:
+    ld a, (burstPort)
+    or 0x04                 ; CTS high, as ay_uart_read leaves it
+    ld b, 0xBF
+    out (c), a
+    ei
+
+burstExit:
+    exx
+    push de
+    exx
+    pop hl                  ; HL = bytes stored
+    pop ix
+    ret
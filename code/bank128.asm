@@ -0,0 +1,193 @@
+;; bank128.asm - 128K write-behind buffer in paged RAM
+;; Bank 1 is paged at 0xC000 to hold downloaded data until it can be
+;; written to SD in large, sector-aligned blocks.
+;; Everything that runs while bank 1 is paged (code, staging buffer and
+;; the stack used by esxDOS) lives in this file. It goes in code_lib, which
+;; the newlib memory map places after the CRT and library code but before
+;; code_compiler (bitstream.c) and code_user, so it stays well below 0xC000
+;; whatever the size of the C code. The Makefile checks _bank128_end in
+;; the .map after linking; bank_detect also checks it at run time.
+
+    SECTION code_lib
+
+    PUBLIC _bank_detect
+    PUBLIC _bank_put
+    PUBLIC _bank_fwrite
+    PUBLIC _bank128_end
+
+defc BANK_PORT  = 0x7FFD
+defc BANKM      = 0x5B5C    ; Last value written to 0x7FFD (128K system variable)
+defc BANK_MAIN  = 0x10      ; ROM 1 (48 BASIC), RAM 0 at 0xC000, normal screen
+defc BANK_WB    = 0x11      ; ROM 1, RAM 1 at 0xC000
+defc STAGE_SIZE = 32
+
+;; ============================================================
+;; LOW-MEMORY STATE
+;; Kept in code_lib (not bss) so it stays visible while bank 1 is paged
+;; ============================================================
+
+bankSrc:        defw 0
+bankDst:        defw 0
+bankLen:        defw 0
+bankChunk:      defw 0
+bankSavedSp:    defw 0
+bankResult:     defw 0
+bankStage:      defs STAGE_SIZE
+bankStack:      defs 96         ; esxDOS + IM1 interrupt while bank 1 is paged
+bankStackTop:
+
+;; ============================================================
+;; bank_detect - Check that bank 1 can be paged at 0xC000
+;; C prototype: uint8_t bank_detect(void);
+;; Writes the complement of the byte at 0xC000 with bank 1 paged and
+;; checks that bank 0 still holds the original. On a 48K machine (or a
+;; 128K locked in 48K mode) the write lands in the only RAM there is;
+;; the byte is restored in every case.
+;; Output: L = 1 if paging works, 0 otherwise (also 0 if any part of this
+;; file was linked at or above 0xC000)
+;; ============================================================
+_bank_detect:
+    ld hl, _bank128_end - 1 ; Last byte of code, stage and stack
+    ld a, h
+    cp 0xC0
+    jr nc, bankNone         ; Would page itself out
+
+    di
+    ld hl, 0xC000
+    ld e, (hl)              ; Byte in bank 0
+    ld bc, BANK_PORT
+    ld a, BANK_WB
+    ld (BANKM), a
+    out (c), a
+    ld a, e
+    cpl
+    ld (hl), a              ; Bank 1 (or bank 0 if paging does nothing)
+    ld a, BANK_MAIN
+    ld (BANKM), a
+    out (c), a
+    ld a, (hl)
+    ld (hl), e              ; Restore bank 0 byte
+    ei
+    cp e
+    jr nz, bankNone
+    ld hl, 1
+    ret
+bankNone:
+    ld hl, 0
+    ret
+
+;; ============================================================
+;; bank_put - Copy a block into the bank 1 buffer
+;; C prototype: void bank_put(const void *src, uint16_t off, uint16_t len) __z88dk_callee;
+;; Stack (sccz80 pushes left to right): [ret addr][len][off][src]
+;; src may be above 0xC000 (ring buffer in bss), so bytes go through a
+;; 32-byte stage: src -> stage with bank 0 paged, stage -> 0xC000+off
+;; with bank 1 paged. The stack is not touched while bank 1 is in.
+;; ============================================================
+_bank_put:
+    pop hl                  ; HL = return address
+    pop bc                  ; BC = len
+    pop de                  ; DE = off
+    ex (sp), hl             ; HL = src, return address back on the stack
+    ld (bankSrc), hl
+    ld (bankLen), bc
+    ld a, d
+    add a, 0xC0
+    ld d, a
+    ld (bankDst), de        ; DE = 0xC000 + off
+
+bankPutLoop:
+    ld bc, (bankLen)
+    ld a, b
+    or c
+    ret z
+
+    ld a, b
+    or a
+    ld a, STAGE_SIZE
+    jr nz, bankPutChunk     ; 256 or more left
+    ld a, c
+    cp STAGE_SIZE
+    jr c, bankPutChunk      ; Last chunk: A = C
+    ld a, STAGE_SIZE
+bankPutChunk:
+    ld c, a
+    ld b, 0                 ; BC = chunk
+    ld (bankChunk), bc
+    ld hl, (bankLen)
+    or a
+    sbc hl, bc
+    ld (bankLen), hl
+
+    ld hl, (bankSrc)
+    ld de, bankStage
+    ldir                    ; src -> stage (bank 0 paged)
+    ld (bankSrc), hl
+
+    di
+    ld bc, BANK_PORT
+    ld a, BANK_WB
+    ld (BANKM), a
+    out (c), a              ; Bank 1 in: no stack from here
+    ld hl, bankStage
+    ld de, (bankDst)
+    ld bc, (bankChunk)
+    ldir                    ; stage -> bank 1
+    ld (bankDst), de
+    ld bc, BANK_PORT
+    ld a, BANK_MAIN
+    ld (BANKM), a
+    out (c), a              ; Bank 0 back
+    ei
+    jr bankPutLoop
+
+;; ============================================================
+;; bank_fwrite - Write the start of the bank 1 buffer to a file
+;; C prototype: uint16_t bank_fwrite(uint8_t handle, uint16_t len) __z88dk_callee;
+;; Stack (sccz80 pushes left to right): [ret addr][len][handle]
+;; ESX_FWRITE runs from 0xC000 with bank 1 paged and SP on bankStack,
+;; so neither the caller's stack nor its code needs to be visible.
+;; Output: HL = bytes written, 0 on error
+;; ============================================================
+_bank_fwrite:
+    pop hl                  ; HL = return address
+    pop bc                  ; BC = len
+    ex (sp), hl             ; L = handle, return address back on the stack
+    ld e, l
+    push ix                 ; On the caller's stack, before the switch
+
+    di
+    ld (bankSavedSp), sp
+    ld sp, bankStackTop
+    ld a, BANK_WB
+    ld (BANKM), a
+    push bc
+    ld bc, BANK_PORT
+    out (c), a              ; Bank 1 in (SP already below 0xC000)
+    pop bc                  ; BC = len
+    ei                      ; FRAMES keeps counting during the write
+
+    ld a, e                 ; A = handle
+    ld ix, 0xC000
+    rst 0x08
+    defb 0x9E               ; ESX_FWRITE
+    jr nc, bankWriteOk
+    ld bc, 0
+bankWriteOk:
+    ld (bankResult), bc
+
+    di
+    ld bc, BANK_PORT
+    ld a, BANK_MAIN
+    ld (BANKM), a
+    out (c), a              ; Bank 0 back
+    ld sp, (bankSavedSp)
+    ei
+
+    pop ix
+    ld hl, (bankResult)
+    ret
+
+;; End of everything that must stay below 0xC000 (checked by bank_detect
+;; and by the Makefile against the .map)
+_bank128_end:
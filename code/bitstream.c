@@ -1,6 +1,6 @@
 // ============================================================================
 // BitStream - FTP Client for ZX Spectrum
-// Uses AY-UART bit-banging at 9600 baud via ESP8266/ESP-12
+// Uses AY-UART bit-banging at 9600/19200 baud via ESP8266/ESP-12
 // ============================================================================
 
 #include <arch/zx.h>
@@ -198,11 +198,12 @@ _not_edit:
 static void main_print(const char *s);
 static void main_newline(void);
 static char* skip_ws(char *p);
+static void str_to_upper(char *s);
 static void invalidate_status_bar(void);
 static uint32_t parse_size_arg(const char *s);
 static void redraw_input_from(uint8_t start_pos);
 static void draw_cursor_underline(uint8_t y, uint8_t col);
-static uint8_t wait_for_ftp_code_fast(uint16_t max_frames, const char *code3);
+static uint16_t parse_decimal(char **pp);
 
 // Screen constants needed by optimization code (full definitions below)
 #define SCREEN_COLS     64
@@ -371,8 +372,22 @@ extern void     ay_uart_init(void);
 extern void     ay_uart_send(uint8_t byte) __z88dk_fastcall;
 extern void     ay_uart_send_block(void *buf, uint16_t len) __z88dk_callee;
 extern uint8_t  ay_uart_read(void);
+extern uint16_t ay_uart_read_burst(void *dst, uint16_t max) __z88dk_callee;
+extern uint16_t ay_uart_read_data(void *dst, uint16_t max) __z88dk_callee;
+extern uint8_t ay_uart_edit;               // ay_uart_read_data stopped on EDIT
 extern uint8_t  ay_uart_ready(void);
 extern uint8_t  ay_uart_ready_fast(void);  // Assumes PORT A already selected
+extern void     ay_uart_set_baud(uint16_t delay) __z88dk_fastcall;
+extern void     ay_uart_hold(uint8_t on) __z88dk_fastcall;  // 1 = CTS high
+extern uint16_t ay_uart_ferr;              // Framing errors counted by ay_uart_read
+
+// ============================================================================
+// EXTERNAL 128K BANK HELPERS (bank128.asm)
+// ============================================================================
+
+extern uint8_t  bank_detect(void);         // 1 = bank 1 can be paged at 0xC000
+extern void     bank_put(const void *src, uint16_t off, uint16_t len) __z88dk_callee;
+extern uint16_t bank_fwrite(uint8_t handle, uint16_t len) __z88dk_callee;
 
 // ============================================================================
 // SCREEN CONFIGURATION
@@ -402,17 +417,18 @@ extern uint8_t  ay_uart_ready_fast(void);  // Assumes PORT A already selected
 // TIMEOUTS
 // ============================================================================
 
-// Hybrid loop counters - for loops with periodic HALT (not every iteration)
-// These are iteration counts, not wall-clock time
-// Used in cmd_ls, cmd_search where HALT is periodic (every 32 iterations)
-#define TIMEOUT_LONG    32000UL   // ~20 segundos con HALT cada 32 iter
+// All timeouts are wall-clock spans in frames (1 frame = 20ms), timed with
+// a struct deadline (see TIME BASE), so they no longer depend on how much
+// work each loop iteration does.
 
-// Silence thresholds - counters that increment only when no data + HALT
-// Wall-clock time = value × 20ms (since HALT happens each increment)
-#define SILENCE_SHORT   150UL     // ~3 segundos
-#define SILENCE_NORMAL  250UL     // ~5 segundos  
-#define SILENCE_LONG    400UL     // ~8 segundos
-#define SILENCE_XLONG   750UL     // ~15 segundos
+// Silence thresholds - deadlines restarted every time data arrives
+#define SILENCE_SHORT   150U      // ~3 segundos
+#define SILENCE_NORMAL  250U      // ~5 segundos  
+#define SILENCE_LONG    400U      // ~8 segundos
+#define SILENCE_XLONG   750U      // ~15 segundos
+
+// Quiet gap that ends a UART flush (late bytes still trickling in)
+#define FLUSH_GAP       2U        // ~40ms, ~38 caracteres a 9600
 
 // Frame-based timeouts (wall-clock, 1 frame = 20ms)
 #define FRAMES_1S       50
@@ -429,12 +445,127 @@ extern uint8_t  ay_uart_ready_fast(void);  // Assumes PORT A already selected
 // Macro para esperar un frame (ahorra código)
 #define HALT() do { __asm__("ei"); __asm__("halt"); } while(0)
 
-#define TIMEOUT_BUSY    800000UL  // ~20-25 segundos de espera activa
-#define SILENCE_BUSY    200000UL  // ~5 segundos sin recibir datos
+// ============================================================================
+// TIME BASE
+// ============================================================================
+// Wall-clock time from the ROM FRAMES counter (IM 1 ISR, 50 Hz). Only the
+// low 16 bits are used (~21 minutes); always compare differences.
+
+#define FRAMES_SYSVAR   23672
+
+struct deadline {
+    uint16_t start;
+    uint16_t span;
+};
+
+static uint16_t frames_now(void)
+{
+    return *(volatile uint16_t *)FRAMES_SYSVAR;
+}
+
+#define frames_since(start) ((uint16_t)(frames_now() - (start)))
+
+// Arm a deadline 'span' frames from now
+static void deadline_start(struct deadline *d, uint16_t span)
+{
+    __asm__("ei");      // FRAMES only runs with interrupts enabled
+    d->start = frames_now();
+    d->span = span;
+}
+
+// Same span, counted again from now (silence timers)
+static void deadline_restart(struct deadline *d)
+{
+    d->start = frames_now();
+}
+
+static uint8_t deadline_expired(const struct deadline *d)
+{
+    return frames_since(d->start) >= d->span;
+}
+
+// Frames left, 0 once expired
+static uint16_t deadline_remaining(const struct deadline *d)
+{
+    uint16_t t = frames_since(d->start);
+    return (t < d->span) ? d->span - t : 0;
+}
+
+// ============================================================================
+// SERVER RTT
+// ============================================================================
+// Each command on the control link is timed up to its first reply line.
+// Smoothed RTT and variance (Jacobson/Karels, fixed point, in frames) turn
+// the fixed reply budgets into caps: timeout = SRTT + 4*RTTVAR, clamped.
+
+#define RTT_FLOOR       FRAMES_1S // Never wait less than this for a reply
+#define RTT_MAX_SAMPLE  500U      // Keeps SRTT*8 and the backoff in 16 bits
+
+static uint16_t rtt_srtt8 = 0;    // Smoothed RTT x8
+static uint16_t rtt_var4 = 0;     // RTT variance x4
+static uint16_t rtt_sent;         // FRAMES when the command went out
+static uint8_t  rtt_valid = 0;    // At least one sample this session
+static uint8_t  rtt_armed = 0;    // Command sent, reply not seen yet
+
+static void rtt_reset(void)
+{
+    rtt_valid = 0;
+    rtt_armed = 0;
+}
+
+// Start timing a command. If the previous one is still armed its reply
+// never came: back off by doubling the variance instead of sampling (Karn).
+static void rtt_arm(void)
+{
+    if (rtt_armed && rtt_valid) {
+        rtt_var4 <<= 1;
+        if (rtt_var4 > RTT_MAX_SAMPLE * 4) rtt_var4 = RTT_MAX_SAMPLE * 4;
+    }
+    rtt_sent = frames_now();
+    rtt_armed = 1;
+}
+
+static void rtt_sample(void)
+{
+    uint16_t r = frames_since(rtt_sent);
+    int16_t err;
+    
+    rtt_armed = 0;
+    if (r > RTT_MAX_SAMPLE) r = RTT_MAX_SAMPLE;
+    if (!rtt_valid) {
+        rtt_srtt8 = r << 3;
+        rtt_var4 = r << 1;                  // RTTVAR = RTT/2
+        rtt_valid = 1;
+        return;
+    }
+    err = (int16_t)r - (int16_t)(rtt_srtt8 >> 3);
+    rtt_srtt8 += err;                       // SRTT += err/8
+    if (err < 0) err = -err;
+    rtt_var4 += err - (rtt_var4 >> 2);      // RTTVAR += (|err| - RTTVAR)/4
+}
+
+// Reply budget for a command whose fixed timeout was 'cap' frames
+static uint16_t rtt_timeout(uint16_t cap)
+{
+    uint16_t t;
+    
+    if (!rtt_valid) return cap;
+    t = (rtt_srtt8 >> 3) + rtt_var4;
+    if (t < RTT_FLOOR) t = RTT_FLOOR;
+    return (t < cap) ? t : cap;
+}
 
 // Forward declaration
 static void print_line64_fast(uint8_t y, const char *s, uint8_t attr);
 
+// Forward declarations (esxDOS file operations, defined below)
+static uint8_t esx_fopen_read(const char *filename);
+static uint8_t esx_fopen_write(const char *filename);
+static uint16_t esx_fread(uint8_t handle, void *buf, uint16_t len);
+static uint16_t esx_fwrite(uint8_t handle, void *buf, uint16_t len);
+static void esx_fclose(uint8_t handle);
+static uint16_t file_write(uint8_t handle, void *buf, uint16_t len);
+
 // ============================================================================
 // RING BUFFER
 // ============================================================================
@@ -446,30 +577,106 @@ static uint16_t rb_tail = 0;
 
 // Line parser state (used by try_read_line and rx_reset_all)
 static char rx_line[128];
-static uint8_t rx_pos = 0;
-static uint8_t rx_overflow = 0;  // Tracks line truncation state
+
+// +IPD demux state (see dmx_poll)
+#define DMX_ESP         0xFF      // rx_link of lines sent by the ESP itself
+
+static char     dmx_ctl[128];     // Control line being assembled across frames
+static uint8_t  dmx_ctl_pos = 0;
+static uint8_t  dmx_ctl_over = 0; // Line too long: drop it at '\n'
+static char     dmx_hdr[64];      // ESP text or "+IPD,<l>,<n>" header
+static uint8_t  dmx_hdr_pos = 0;
+static uint8_t  dmx_in = 0;       // Link of the +IPD payload in progress
+static uint16_t dmx_left = 0;     // Payload bytes of that +IPD not parsed yet
+static uint8_t  dmx_link = 0;     // Link of the last CLOSED/CONNECT event
+static uint8_t  dmx_closed = 0;   // Bit n: "n,CLOSED" seen (consumers clear)
+static uint8_t  dmx_connect = 0;  // Bit n: "n,CONNECT" seen
+
+// FTP data links rotate over ESP links 1-4: the next PASV/RETR never waits
+// for the previous socket, and its late bytes are dropped by link number.
+#define DATA_LINK_FIRST 1
+#define DATA_LINK_LAST  4
+static uint8_t  data_link = DATA_LINK_FIRST;
+static uint8_t  rx_link = DMX_ESP;  // Source of the line in rx_line
+
+static void dmx_reset(void)
+{
+    dmx_hdr_pos = 0;
+    dmx_left = 0;
+    dmx_ctl_pos = 0;
+    dmx_ctl_over = 0;
+}
 
 // Adaptive drain control - balances UI responsiveness vs transfer speed
+#define DRAIN_TYPING    8     // User typing - DI windows well under a frame
 #define DRAIN_NORMAL    32    // UI responsive (keyboard checks) - max ~32ms block
 #define DRAIN_FAST      255   // Max throughput (transfers)
 
+#define KEY_IDLE_FRAMES 25    // Frames without a key before leaving DRAIN_TYPING
+
 static uint8_t uart_drain_limit = DRAIN_NORMAL;
 
 // Switch drain modes
 static void drain_mode_fast(void) { uart_drain_limit = DRAIN_FAST; }
 static void drain_mode_normal(void) { uart_drain_limit = DRAIN_NORMAL; }
 
-static uint8_t rb_full(void)
+// ============================================================================
+// CTS BACK-PRESSURE
+// ============================================================================
+// CTS high tells the ESP (flow control 2) to stop after the byte in flight.
+// Holds nest: ring near full, SD writes, screen output. When the last one
+// is released CTS goes low and the ESP resumes from its own buffer.
+
+#define RB_HOLD_FREE    32    // Hold when fewer free bytes are left in the ring
+
+static uint8_t cts_holders = 0;
+static uint8_t rb_holding = 0;
+static uint8_t uart_flow = 0;       // ESP confirmed CTS flow control
+static uint8_t rx_idle = 1;         // Last receive ended on an idle line
+
+static void cts_hold(void)
+{
+    if (cts_holders++ == 0) ay_uart_hold(1);
+}
+
+static void cts_release(void)
+{
+    if (cts_holders && --cts_holders == 0) ay_uart_hold(0);
+}
+
+// Ring emptied (flush/reset): drop its hold so late bytes can be drained
+static void rb_hold_clear(void)
 {
-    return ((uint16_t)(rb_head + 1) & 0x1FF) == rb_tail; // MÁSCARA 0x1FF
+    if (rb_holding) { rb_holding = 0; cts_release(); }
+}
+
+// Free bytes from rb_head up to the wrap point (one slot always stays empty)
+static uint16_t rb_contig_free(void)
+{
+    if (rb_tail > rb_head) return rb_tail - rb_head - 1;
+    return RING_BUFFER_SIZE - rb_head - (rb_tail == 0);
+}
+
+// High-water mark: hold before the ring fills. A burst still catches
+// what is already on the wire (a held CTS is not lowered).
+static void rb_hold_update(void)
+{
+    if ((uint16_t)((rb_tail - rb_head - 1) & 0x1FF) < RB_HOLD_FREE) {
+        if (!rb_holding) { rb_holding = 1; cts_hold(); }
+    } else {
+        rb_hold_clear();
+    }
 }
 
 static void uart_drain_to_buffer(void)
 {
-    uint8_t max_loop = uart_drain_limit;
+    uint16_t budget = uart_drain_limit;
+    uint16_t room, got;
+    uint8_t pass;
     
-    // OPTIMIZATION: Select AY PORT A once, then use fast version in loop
-    // This saves ~8 cycles per iteration (out + setup)
+    rb_hold_update();
+    
+    // OPTIMIZATION: Select AY PORT A once for the ready probe
     // Safe because we control the entire scope
     #asm
         ld   bc, 0xFFFD
@@ -477,11 +684,26 @@ static void uart_drain_to_buffer(void)
         out  (c), a         ; Select PORT A once
     #endasm
     
-    while (ay_uart_ready_fast() && max_loop > 0) {
-        if (rb_full()) break;
-        ring_buffer[rb_head] = ay_uart_read();
-        rb_head = (rb_head + 1) & 0x1FF;  // MÁSCARA 0x1FF
-        max_loop--;
+    if (!ay_uart_ready_fast()) {
+        rx_idle = 1;
+        return;
+    }
+    rx_idle = 0;
+    
+    // Whole burst in one DI window straight into the ring. Second pass only
+    // when the first one stopped at the wrap point with the line still busy.
+    for (pass = 0; pass < 2; pass++) {
+        room = rb_contig_free();
+        if (room > budget) room = budget;
+        if (room == 0) break;
+        
+        got = ay_uart_read_burst(&ring_buffer[rb_head], room);
+        rb_head = (rb_head + got) & 0x1FF;  // MÁSCARA 0x1FF
+        budget -= got;
+        if (got < room) {               // Line went idle
+            rx_idle = 1;
+            break;
+        }
     }
 }
 
@@ -493,14 +715,35 @@ static int16_t rb_pop(void)
     return result;
 }
 
+// Writes up to max bytes from the ring tail to a file straight from
+// ring_buffer: one ESX_FWRITE per contiguous span, two at the wrap point.
+// Returns bytes taken from the ring.
+static uint16_t rb_write(uint8_t handle, uint16_t max)
+{
+    uint16_t n;
+    uint16_t total = 0;
+    
+    while (max && rb_head != rb_tail) {
+        n = (rb_head > rb_tail) ? rb_head - rb_tail : RING_BUFFER_SIZE - rb_tail;
+        if (n > max) n = max;
+        file_write(handle, &ring_buffer[rb_tail], n);
+        rb_tail = (rb_tail + n) & 0x1FF;  // MÁSCARA 0x1FF
+        total += n;
+        max -= n;
+    }
+    return total;
+}
+
 static void rb_flush(void)
 {
     uint16_t max = 500;
+    rb_hold_clear();
     while (ay_uart_ready() && max > 0) {
         ay_uart_read();
         max--;
     }
     rb_head = rb_tail = 0;
+    dmx_reset();
 }
 
 // ============================================================================
@@ -509,32 +752,30 @@ static void rb_flush(void)
 // Three levels of RX state that must be kept consistent:
 //   1. UART hardware buffer (ay_uart_read drains it)
 //   2. Ring buffer (rb_head, rb_tail)  
-//   3. Line parser (rx_pos, rx_line partial content)
+//   3. Demux (dmx_left, partial ESP text and control line)
 //
-// rx_reset_all() - Full reset: UART + ring buffer + parser
+// rx_reset_all() - Full reset: UART + ring buffer + demux
 // rb_flush()     - Ring buffer + UART drain (legacy, used in data transfers)
-// rx_pos = 0     - Parser only (use when just finished processing a line)
 
 static void rx_reset_all(void)
 {
     // 1. Drain UART with patience for late bytes
-    uint16_t max_wait = 300;
+    struct deadline gap;
     uint16_t max_bytes = 500;
-    while (max_bytes > 0) {
+    rb_hold_clear();
+    deadline_start(&gap, FLUSH_GAP);
+    while (max_bytes > 0 && !deadline_expired(&gap)) {
         if (ay_uart_ready()) {
             ay_uart_read();
             max_bytes--;
-            max_wait = 50;
-        } else {
-            if (max_wait == 0) break;
-            max_wait--;
+            deadline_restart(&gap);
         }
     }
     // 2. Clear ring buffer
     rb_head = rb_tail = 0;
-    // 3. Reset line parser (rx_pos and rx_overflow are defined later but linked globally)
-    rx_pos = 0;
-    rx_overflow = 0;
+    // 3. Reset demux and line parser
+    dmx_reset();
+    dmx_closed = dmx_connect = 0;
 }
 
 // ============================================================================
@@ -546,16 +787,10 @@ static void rx_reset_all(void)
 static char tx_buffer[TX_BUFFER_SIZE];
 static char ftp_cmd_buffer[128];
 
-// File write buffer - 512 bytes for efficient SD writes
-static uint8_t file_buffer[512];
-static uint16_t file_buf_pos = 0;
-
 // ============================================================================
 // COMMON STRINGS (save code space)
 // ============================================================================
 
-static const char S_IPD0[] = "+IPD,0,";
-static const char S_IPD1[] = "+IPD,1,";
 static const char S_CLOSED1[] = "1,CLOSED";
 static const char S_PASV_FAIL[] = "PASV failed";
 static const char S_DATA_FAIL[] = "Data connect failed";
@@ -565,7 +800,6 @@ static const char S_CANCEL[]    = "Cancelled";
 static const char S_DOTS[]      = ".";
 static const char S_ERROR_TAG[] = "Error: ";
 static const char S_AT_CLOSE0[] = "AT+CIPCLOSE=0\r\n";
-static const char S_AT_CIPMUX[] = "AT+CIPMUX=1\r\n";
 static const char S_CMD_QUIT[]  = "QUIT\r\n";
 
 // Repeated UI strings (saves ~50 bytes)
@@ -596,6 +830,8 @@ static char wifi_client_ip[16] = "0.0.0.0";
 static char ftp_host[32] = "---";
 static char ftp_user[20] = "---";
 static char ftp_path[PATH_SIZE] = "---";
+static char ftp_pass[20];            // Kept for QUEUE entries
+static uint16_t ftp_port = 21;
 static char data_ip[16];
 
 static uint16_t data_port = 0;
@@ -611,6 +847,27 @@ connection_state = STATE_WIFI_OK;
     invalidate_status_bar();
 }
 
+// Sesión perdida (no un QUIT/OPEN del usuario): se recuerda host, puerto,
+// usuario y path para que el siguiente comando que necesite login la
+// rehaga sola (session_recover). La contraseña sigue en ftp_pass.
+static char     sess_host[32];       // "" = nothing to recover
+static char     sess_user[20];
+static char     sess_path[PATH_SIZE];
+static uint16_t sess_port;
+static const char *login_path;       // cmd_user: CWD here right after login
+static uint8_t  mir_active;          // Session opened by !MIRRORS OPEN
+
+static void session_lost(void)
+{
+    if (connection_state == STATE_LOGGED_IN) {
+        safe_copy(sess_host, ftp_host, sizeof(sess_host));
+        safe_copy(sess_user, ftp_user, sizeof(sess_user));
+        safe_copy(sess_path, ftp_path, sizeof(sess_path));
+        sess_port = ftp_port;
+    }
+    clear_ftp_state();
+}
+
 // ============================================================================
 // SCREEN STATE
 // ============================================================================
@@ -1342,6 +1599,7 @@ static void main_print(const char *s)
     // use the fast renderer which is 3-4x faster than char-by-char
     uint8_t len = strlen(s);
     
+    cts_hold();  // Scroll + render: ESP waits instead of overrunning us
     if (main_col == 0 && len <= SCREEN_COLS) {
         // Fast path: render entire line at once
         print_line64_fast(main_line, s, current_attr);
@@ -1352,7 +1610,7 @@ static void main_print(const char *s)
         main_puts(s);
         main_newline();
     }
-
+    cts_release();
 }
 
 // Centralized error print (reduces duplicated ATTR_ERROR + main_print sequences)
@@ -1645,17 +1903,15 @@ static uint8_t read_key(void)
 
 static void uart_flush_rx(void)
 {
-    uint16_t max_wait = 500;
+    struct deadline gap;
     uint16_t max_bytes = 500;
     
-    while (max_bytes > 0) {
+    deadline_start(&gap, FLUSH_GAP);
+    while (max_bytes > 0 && !deadline_expired(&gap)) {
         if (ay_uart_ready()) {
             ay_uart_read();
             max_bytes--;
-            max_wait = 100;
-        } else {
-            if (max_wait == 0) break;
-            max_wait--;
+            deadline_restart(&gap);
         }
     }
 }
@@ -1675,18 +1931,40 @@ static void uart_send_string(const char *s)
     while (*s) ay_uart_send(*s++);
 }
 
+// ============================================================================
+// RECEIVE SCHEDULER
+// ============================================================================
+// The UART is bit-banged: every byte that starts while the CPU sleeps in
+// HALT is lost. While a socket is open, waits poll the UART continuously
+// and take wall-clock time from the ROM FRAMES counter (see TIME BASE).
+
+// One 50 Hz tick: drain until FRAMES changes, or HALT with no socket open
+static void rx_wait_frame(void)
+{
+    uint16_t f;
+    
+    if (connection_state < STATE_FTP_CONNECTED) {
+        HALT();
+        return;
+    }
+    __asm__("ei");
+    f = frames_now();
+    while (frames_now() == f) uart_drain_to_buffer();
+}
+
 // Wait N video frames (wall-clock pacing). Assumes interrupts enabled.
 static void wait_frames(uint16_t frames)
 {
-    while (frames--) HALT();
+    while (frames--) rx_wait_frame();
 }
 
+// Wait N frames draining the UART, whatever the connection state
 static void wait_drain(uint16_t frames)
 {
-    while (frames--) {
-        HALT();
-        uart_drain_to_buffer(); // <--- ESTO ES LA CLAVE
-    }
+    struct deadline dl;
+    
+    deadline_start(&dl, frames);
+    while (!deadline_expired(&dl)) uart_drain_to_buffer();
 }
 
 static void esp_send_at(const char *cmd)
@@ -1702,47 +1980,213 @@ static void esp_send_at(const char *cmd)
     uart_send_string(S_CRLF);
 }
 
-static uint8_t try_read_line(void)
+// ============================================================================
+// +IPD DEMULTIPLEXER
+// ============================================================================
+// Single streaming parser between ring_buffer and every consumer:
+//   "+IPD,0,n:" payload -> control lines in rx_line (rx_link = 0), also when
+//                          a reply is split across frames or shares one
+//   "+IPD,d,n:" payload -> left in the ring for dmx_write()/dmx_getc(),
+//                          d = data_link; other links are dropped
+//   ESP text lines      -> rx_line with rx_link = DMX_ESP
+//   "n,CLOSED" / "n,CONNECT" are ESP lines that also raise an event
+// Parsing stops at every event, so the ring is the queue for both links:
+// nothing past a line or a data payload is consumed until it was taken.
+
+#define DMX_NONE        0     // Nothing complete yet
+#define DMX_LINE        1     // Line in rx_line
+#define DMX_DATA        2     // Data link payload is next in the ring (dmx_left)
+#define DMX_CLOSED      3     // "n,CLOSED" in rx_line, n in dmx_link
+#define DMX_CONNECT     4     // "n,CONNECT" in rx_line, n in dmx_link
+#define DMX_PROMPT      5     // CIPSEND '>' prompt
+
+#define RX_CANCEL       0xFFFF    // dmx_got: EDIT pressed
+
+static uint16_t dmx_got = 0;      // Payload bytes the last dmx_poll received
+
+static void dmx_fill(void);
+
+static uint8_t dmx_poll(void)
 {
+    int16_t c;
+    char *p;
+    
+    dmx_got = 0;
+    if (dmx_left && dmx_in == data_link) {  // Reader hasn't taken it all yet
+        dmx_fill();                         // Hot loop instead of the drain
+        return DMX_DATA;
+    }
     uart_drain_to_buffer();
     
-    int16_t c;
     while ((c = rb_pop()) != -1) {
+        // Control payload: lines are assembled across +IPD frames
+        if (dmx_left) {
+            dmx_left--;
+            if (dmx_in != 0 || c == '\r') continue;  // Old data links are not ours
+            if (c == '\n') {
+                if (dmx_ctl_over || dmx_ctl_pos == 0) {
+                    dmx_ctl_over = 0;                 // Drop truncated line
+                    dmx_ctl_pos = 0;
+                    continue;
+                }
+                memcpy(rx_line, dmx_ctl, dmx_ctl_pos);
+                rx_line[dmx_ctl_pos] = '\0';
+                dmx_ctl_pos = 0;
+                rx_link = 0;
+                return DMX_LINE;
+            }
+            if (dmx_ctl_pos < sizeof(dmx_ctl) - 1) dmx_ctl[dmx_ctl_pos++] = (char)c;
+            else dmx_ctl_over = 1;
+            continue;
+        }
+        
+        // ESP text
         if (c == '\r') continue;
         if (c == '\n') {
-            rx_line[rx_pos] = '\0';
-            
-            // If we had overflow, discard this line entirely
-            if (rx_overflow) {
-                rx_overflow = 0;
-                rx_pos = 0;
-                continue;  // Skip this truncated line
-            }
-            
-            if (rx_pos > 0) {
-                // Debug output (only if both flags set)
-                if (debug_mode && debug_enabled) {
-                    uint8_t saved_attr = current_attr;
-                    current_attr = ATTR_RESPONSE;
-                    main_puts("<< ");
-                    main_print(rx_line);
-                    current_attr = saved_attr;
+            if (dmx_hdr_pos == 0) continue;
+            dmx_hdr[dmx_hdr_pos] = '\0';
+            memcpy(rx_line, dmx_hdr, dmx_hdr_pos + 1);
+            dmx_hdr_pos = 0;
+            rx_link = DMX_ESP;
+            if (rx_line[1] == ',' && rx_line[0] >= '0' && rx_line[0] <= '4') {
+                dmx_link = rx_line[0] - '0';
+                if (strcmp(rx_line + 2, "CLOSED") == 0) {
+                    dmx_closed |= (uint8_t)(1 << dmx_link);
+                    return DMX_CLOSED;
+                }
+                if (strcmp(rx_line + 2, "CONNECT") == 0) {
+                    dmx_connect |= (uint8_t)(1 << dmx_link);
+                    return DMX_CONNECT;
                 }
-                rx_pos = 0;
-                return 1;
             }
+            return DMX_LINE;
+        }
+        if (c == ':' && dmx_hdr_pos > 7 && dmx_hdr[6] == ',' &&
+            strncmp(dmx_hdr, "+IPD,", 5) == 0) {
+            dmx_hdr[dmx_hdr_pos] = '\0';
+            p = dmx_hdr + 7;
+            dmx_left = parse_decimal(&p);
+            dmx_in = dmx_hdr[5] - '0';
+            dmx_hdr_pos = 0;
+            if (dmx_left && dmx_in == data_link) return DMX_DATA;
             continue;
         }
-        
-        // Accumulate character or set overflow flag
-        if (rx_pos < sizeof(rx_line) - 1) {
-            rx_line[rx_pos++] = (char)c;
-        } else {
-            // Buffer full - enter overflow mode, discard until \n
-            rx_overflow = 1;
+        if (c == '>' && dmx_hdr_pos == 0) return DMX_PROMPT;
+        if (dmx_hdr_pos < sizeof(dmx_hdr) - 1) dmx_hdr[dmx_hdr_pos++] = (char)c;
+    }
+    return DMX_NONE;
+}
+
+// The two ring halves are the write buffers (see dmx_write)
+#define WR_HALF         (RING_BUFFER_SIZE / 2)
+#define WR_FORCE        (RING_BUFFER_SIZE - RB_HOLD_FREE)
+
+static uint16_t wr_forced = 0;    // Writes done while data was still arriving
+
+// Fused receive of data link payload straight from the UART into the ring's
+// free span, called by dmx_poll while DMX_DATA is pending. ay_uart_read_data
+// counts the rest of the +IPD down in registers and only stops at its end,
+// at the end of the free span or on EDIT, so a whole frame lands in one
+// call. Once the payload is all in the ring, the bytes past its end go
+// through the usual drain and the demux. Sets dmx_got (RX_CANCEL on EDIT).
+static void dmx_fill(void)
+{
+    uint16_t used = (rb_head - rb_tail) & 0x1FF;
+    uint16_t max;
+    
+    if (used >= dmx_left) {
+        uart_drain_to_buffer();
+        return;
+    }
+    rb_hold_update();
+    max = rb_contig_free();
+    if (max > dmx_left - used) max = dmx_left - used;
+    if (max == 0) return;                   // Reader frees the span first
+    dmx_got = ay_uart_read_data(&ring_buffer[rb_head], max);
+    rx_idle = (dmx_got < max);
+    rb_head = (rb_head + dmx_got) & 0x1FF;
+    if (ay_uart_edit) dmx_got = RX_CANCEL;
+}
+
+// Writes data link payload to a file straight from the ring (no copy).
+// The ring halves act as two write buffers: a full half, or the end of the
+// +IPD (it must leave the ring before the next header can be parsed), is
+// only written while the line is quiet: idle between +IPD frames, or the
+// ESP stopped by a ring hold it honours. Near overflow the write goes
+// ahead anyway and is counted in wr_forced. 'final' writes what is left.
+// Returns bytes written.
+static uint16_t dmx_write(uint8_t handle, uint8_t final)
+{
+    uint16_t used;
+    uint16_t n;
+    uint8_t quiet;
+    
+    if (!dmx_left || dmx_in != data_link) return 0;
+    used = (rb_head - rb_tail) & 0x1FF;
+    n = (used < dmx_left) ? used : dmx_left;
+    if (!n) return 0;
+    if (!final) {
+        quiet = rx_idle || (rb_holding && uart_flow);
+        if (used < WR_FORCE) {
+            if (!quiet) return 0;
+            if (n < WR_HALF && n < dmx_left) return 0;
+        } else if (!quiet) {
+            wr_forced++;
         }
     }
-    return 0;
+    n = rb_write(handle, n);
+    dmx_left -= n;
+    return n;
+}
+
+// Next data link payload byte, -1 if none is in the ring yet
+static int16_t dmx_getc(void)
+{
+    int16_t c;
+    if (!dmx_left || dmx_in != data_link) return -1;
+    c = rb_pop();
+    if (c != -1) dmx_left--;
+    return c;
+}
+
+// Drops the data link payload already in the ring (callers that only want
+// lines). Returns bytes dropped.
+static uint16_t dmx_skip(void)
+{
+    uint16_t n = 0;
+    while (dmx_left && dmx_in == data_link && rb_pop() != -1) {
+        dmx_left--;
+        n++;
+    }
+    return n;
+}
+
+static uint8_t try_read_line(void)
+{
+    uint8_t ev;
+    
+    while (1) {
+        ev = dmx_poll();
+        if (ev == DMX_DATA) {
+            if (dmx_skip()) continue;
+            return 0;
+        }
+        if (ev == DMX_NONE) return 0;
+        if (ev != DMX_PROMPT) break;
+    }
+    
+    // First control-link line after a command closes its RTT sample
+    if (rtt_armed && rx_link == 0) rtt_sample();
+    
+    // Debug output (only if both flags set)
+    if (debug_mode && debug_enabled) {
+        uint8_t saved_attr = current_attr;
+        current_attr = ATTR_RESPONSE;
+        main_puts(rx_link == 0 ? "<0 " : "<< ");
+        main_print(rx_line);
+        current_attr = saved_attr;
+    }
+    return 1;
 }
 
 // Unified response wait function
@@ -1751,20 +2195,15 @@ static uint8_t try_read_line(void)
 // Returns 1 on success, 0 on failure/timeout
 static uint8_t wait_for_string(const char *expected, uint16_t max_frames)
 {
-    uint16_t frames = 0;
-    
-    rx_pos = 0;
+    struct deadline dl;
     
-    while (frames < max_frames) {
-        HALT();
-        
-        // Cancelación con EDIT después de HALT (sincronizado con vsync)
+    deadline_start(&dl, max_frames);
+    while (!deadline_expired(&dl)) {
+        // Cancelación con EDIT
         if (key_edit_down()) {
             return 0;
         }
         
-        uart_drain_to_buffer();
-        
         if (try_read_line()) {
             // Check failure conditions FIRST (critical for CIPSTART)
             if (strstr(rx_line, "CONNECT FAIL") != NULL) return 0;
@@ -1775,11 +2214,8 @@ static uint8_t wait_for_string(const char *expected, uint16_t max_frames)
             // Check success conditions
             if (expected != NULL && strstr(rx_line, expected) != NULL) return 1;
             if (rx_line[0] == 'O' && rx_line[1] == 'K') return 1;
-            
-            rx_pos = 0;
         }
         
-        frames++;
     }
     
     return 0;
@@ -1788,25 +2224,135 @@ static uint8_t wait_for_string(const char *expected, uint16_t max_frames)
 // Legacy wrapper for code clarity
 #define wait_for_response(max_frames) wait_for_string(NULL, max_frames)
 
+// ============================================================================
+// UART SPEED PROFILES
+// ============================================================================
+// ay_uart_init leaves both ends at 9600 (UART_DEF). Faster profiles are set
+// with AT+UART_CUR, which the ESP does not persist: a module reset always
+// brings the link back to 9600.
+//
+// Delays are loop counts for the bit-banged driver (26 T-states each). At
+// 38400 and above a bit is shorter than the driver's fixed per-bit overhead
+// (~85 T RX, ~140 T TX), so 19200 is the fastest profile offered.
+
+#define BAUD_9600       0
+#define BAUD_19200      1
+#define BAUD_PROFILES   2
+
+// Framing errors per check window that trigger a fallback to the next profile
+#define FERR_FALLBACK   8
+
+static const uint16_t baud_rate[BAUD_PROFILES]  = { 9600, 19200 };
+static const uint8_t  baud_delay[BAUD_PROFILES] = { 11, 4 };
+
+static uint8_t  uart_speed = BAUD_9600;
+static uint16_t uart_ferr_mark = 0;   // ay_uart_ferr at the start of the window
+
+// AT round trip at the current rate. Returns 1 on OK.
+static uint8_t esp_at_ping(void)
+{
+    rx_reset_all();
+    uart_send_string("AT\r\n");
+    return wait_for_response(FRAMES_1S);
+}
+
+// Same framing as the boot-time UART_DEF (8N1, CTS flow control)
+static void esp_uart_cur(uint8_t profile)
+{
+    char *p = tx_buffer;
+    p = str_append(p, "AT+UART_CUR=");
+    p = u16_to_dec(p, baud_rate[profile]);
+    p = str_append(p, ",8,1,0,2");
+    esp_send_at(tx_buffer);
+}
+
+// ay_uart_hold only works if the ESP honours CTS. UART_DEF at boot asks for
+// it, but a module that missed the blind high-speed sequence keeps its old
+// setting. Re-issue UART_CUR when flow control is off.
+// Returns 1 if CTS flow control is (now) enabled.
+static uint8_t esp_flow_check(void)
+{
+    struct deadline dl;
+    char *p;
+
+    rx_reset_all();
+    esp_send_at("AT+UART_CUR?");
+    deadline_start(&dl, FRAMES_1S);
+    if (wait_for_string("+UART_CUR:", FRAMES_1S)) {
+        p = strrchr(rx_line, ',');
+        // Trailing OK: rest of the second plus a short grace
+        wait_for_response(deadline_remaining(&dl) + FRAMES_1S / 5);
+        if (p && (p[1] == '2' || p[1] == '3')) return 1;
+    }
+    esp_uart_cur(uart_speed);
+    return wait_for_response(FRAMES_1S);
+}
+
+// Switches both ends to a profile and verifies the link with AT.
+// On failure the previous profile is restored on both ends.
+// Returns 1 if the requested profile is active.
+static uint8_t uart_set_speed(uint8_t profile)
+{
+    uint8_t old = uart_speed;
+    if (profile == old) return 1;
+
+    esp_uart_cur(profile);
+    // OK arrives at the old rate, then the ESP switches
+    wait_for_response(FRAMES_1S / 2);
+    ay_uart_set_baud(baud_delay[profile]);
+    wait_frames(2);
+
+    if (esp_at_ping()) {
+        uart_speed = profile;
+        uart_ferr_mark = ay_uart_ferr;
+        return 1;
+    }
+
+    // No clean reply: we don't know if the ESP switched. Ask it to go back
+    // at the new rate (harmless if it never left), then verify at the old one.
+    esp_uart_cur(old);
+    wait_frames(2);
+    ay_uart_set_baud(baud_delay[old]);
+    wait_frames(2);
+    esp_at_ping();
+    uart_ferr_mark = ay_uart_ferr;
+    return 0;
+}
+
+// Called periodically from idle points (never mid-transfer). Drops one
+// profile when framing errors rose too fast during the last window.
+static void uart_check_errors(void)
+{
+    uint16_t errors = ay_uart_ferr - uart_ferr_mark;
+    uart_ferr_mark = ay_uart_ferr;
+
+    if (uart_speed == BAUD_9600 || errors < FERR_FALLBACK) return;
+
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "Line errors, falling back to ");
+        p = u16_to_dec(p, baud_rate[uart_speed - 1]);
+    }
+    fail(tx_buffer);
+    uart_set_speed(uart_speed - 1);
+}
+
 // ============================================================================
 // DETECCIÓN DE DESCONEXIÓN FTP
 // ============================================================================
-// El servidor envía 421 dentro de +IPD: "+IPD,0,XX:421 Timeout".
+// El servidor envía 421 por el canal de control (rx_link 0): "421 Timeout".
 // También puede enviar "0,CLOSED" directamente del ESP
 // Returns: 0=no disconnect, 1=socket closed, 2=server 421
 
 static uint8_t check_disconnect_message(void)
 {
     // Socket cerrado por ESP
-    if (strncmp(rx_line, "0,CLOSED", 8) == 0) {
+    if (rx_link == DMX_ESP && strncmp(rx_line, "0,CLOSED", 8) == 0) {
         return 1;
     }
-    // 421 viene dentro de +IPD,0,XX:421...
-   if (strncmp(rx_line, S_IPD0, 7) == 0) {
-        char *payload = strchr(rx_line, ':');
-        if (payload && strncmp(payload + 1, "421", 3) == 0) {
-            return 2;
-        }
+    // 421 llega como línea de control (el demux ya quitó "+IPD,0,XX:")
+    if (rx_link == 0 && strncmp(rx_line, "421", 3) == 0) {
+        return 2;
     }
     return 0;
 }
@@ -1823,7 +2369,7 @@ static uint8_t check_disconnect_message(void)
 static uint8_t probe_esp(void)
 {
     uint8_t tries;
-    uint16_t timeout;
+    struct deadline dl;
     
     // Intentar 3 veces, igual que espATZX
     for (tries = 0; tries < 3; tries++) {
@@ -1833,12 +2379,10 @@ static uint8_t probe_esp(void)
         
         uart_send_string("AT\r\n");
         
-        rx_pos = 0;
         rb_flush(); // Reseteamos el buffer circular
-        timeout = 0;
-        
         // Usamos FRAMES_1S (50 frames) como timeout, igual que la lógica de espATZX
-        while (timeout < FRAMES_1S) {
+        deadline_start(&dl, FRAMES_1S);
+        while (!deadline_expired(&dl)) {
             
             // Drenar hardware al buffer circular
             uart_drain_to_buffer();
@@ -1852,12 +2396,9 @@ static uint8_t probe_esp(void)
                 
                 // Debug: Si quieres ver qué recibe, descomenta esto temporalmente:
                 // main_print(rx_line); 
-                
-                rx_pos = 0;
             }
             
             wait_frames(1);
-            timeout++;
         }
     }
     return 0;
@@ -1865,7 +2406,7 @@ static uint8_t probe_esp(void)
 
 static uint8_t check_wifi_connection(void)
 {
-    uint16_t frames = 0;
+    struct deadline dl;
     int16_t c;
     uint8_t dot_count = 0;
     uint8_t digit_count = 0;
@@ -1876,9 +2417,8 @@ static uint8_t check_wifi_connection(void)
     uart_send_string("AT+CIFSR\r\n");
     
     // Timeout ~4 segundos (200 frames)
-    while (frames < 200 && !found_ip) {
-        HALT();
-        
+    deadline_start(&dl, 200);
+    while (!deadline_expired(&dl) && !found_ip) {
         // Cancelación con EDIT
         if (key_edit_down()) {
             uart_flush_rx();  // Limpiar buffer en cancelación
@@ -1934,7 +2474,6 @@ static uint8_t check_wifi_connection(void)
             }
         }
         
-        frames++;
     }
     
 done:
@@ -1944,33 +2483,163 @@ done:
 
 
 // ============================================================================
-// NUEVA INICIALIZACIÓN OPTIMISTA (Estilo espATZX + Lógica FTP)
+// ESP INIT SEQUENCER
 // ============================================================================
+// Each step moves on as soon as OK/ERROR is parsed; the old fixed delays
+// are only timeouts now. A step with a query is skipped when the reply to
+// the query already shows the wanted state.
+
+#define STEP_NOREPLY    0x01      // No OK expected: send, drain 'frames', flush
+
+struct init_step {
+    const char *cmd;              // Without CRLF (added unless STEP_NOREPLY)
+    const char *query;            // NULL = always run
+    const char *want;             // Query reply meaning "done" (NULL = any OK)
+    uint8_t frames;               // Timeout
+    uint8_t flags;
+};
 
-// 1. Función auxiliar para configurar modo FTP (CIPMUX=1)
-// Se usa tanto en el arranque rápido como en el lento.
-static void setup_ftp_mode(void)
+static const struct init_step init_steps[] = {
+    { "+++",            "AT",           NULL,        10, STEP_NOREPLY }, // Salir de modo transparente
+    { "ATE0",           NULL,           NULL,        10, 0 },            // Sin eco
+    { "AT+CIPSERVER=0", NULL,           NULL,        10, 0 },            // Parar servidor TCP
+    { "AT+CIPCLOSE=5",  NULL,           NULL,        25, 0 },            // Cerrar todos los links
+    { "AT+CIPMUX=1",    "AT+CIPMUX?",   "+CIPMUX:1", 10, 0 },            // Multi-conexión (FTP)
+    { NULL,             NULL,           NULL,        0,  0 }
+};
+
+// Sends an AT command; returns 1 if it ends in OK and, when 'want' is set,
+// a reply line contained it.
+static uint8_t esp_query(const char *cmd, const char *want, uint16_t frames)
 {
-    uint8_t i;
-    // Aseguramos ATE0 por si acaso
-    uart_send_string("ATE0\r\n");
-    for (i=0; i<5; i++) HALT();
-    while (ay_uart_ready()) ay_uart_read();
+    struct deadline dl;
+    uint8_t found = 0;
+    
+    esp_send_at(cmd);
+    deadline_start(&dl, frames);
+    while (!deadline_expired(&dl)) {
+        if (!try_read_line()) continue;
+        if (want && strstr(rx_line, want)) found = 1;
+        if (rx_line[0] == 'O' && rx_line[1] == 'K') return want ? found : 1;
+        if (rx_line[0] == 'E' && rx_line[1] == 'R' && rx_line[2] == 'R') return 0;
+    }
+    return 0;
+}
 
-    // IMPRESCINDIBLE PARA FTP: Múltiples conexiones
-    uart_send_string(S_AT_CIPMUX);
-    for (i=0; i<5; i++) HALT();
-    while (ay_uart_ready()) ay_uart_read();
+static void esp_init_run(const struct init_step *st)
+{
+    rx_reset_all();
+    for (; st->cmd; st++) {
+        if (st->query && esp_query(st->query, st->want, st->frames)) continue;
+        if (st->flags & STEP_NOREPLY) {
+            uart_send_string(st->cmd);
+            wait_drain(st->frames);
+            rx_reset_all();
+            continue;
+        }
+        esp_send_at(st->cmd);
+        wait_for_response(st->frames);  // OK o ERROR: el siguiente paso sigue igual
+    }
 }
 
-// 2. Inicialización completa (Fallback cuando algo va mal)
-// Esta es la versión robusta que discutimos antes
-static void full_initialization_sequence(void)
+// ============================================================================
+// ESP CAPABILITIES
+// ============================================================================
+// AT firmware builds differ in what they support. The features below are
+// probed once per firmware (keyed by the AT+GMR "AT version" line) and the
+// bitmap is kept in BITSTRM.CAP, so later boots only cost one AT+GMR.
+// The last byte of the cached version line holds CAP_COUNT, so a cache
+// written with a different bit layout is probed again.
+
+#define CAP_RECVMODE    0x01      // AT+CIPRECVMODE (passive receive)
+#define CAP_UART_CUR    0x02      // AT+UART_CUR (speed profiles, CTS)
+#define CAP_DINFO       0x04      // AT+CIPDINFO (short +IPD headers)
+#define CAP_DOMAIN      0x08      // AT+CIPDOMAIN (DNS lookup)
+#define CAP_COUNT       4
+
+#define CAP_VER_LEN     32
+
+static const char S_CAP_FILE[] = "BITSTRM.CAP";
+
+static const char * const cap_probe[CAP_COUNT] = {
+    "AT+CIPRECVMODE?", "AT+UART_CUR?", "AT+CIPDINFO?", "AT+CIPDOMAIN=?"
+};
+static const char * const cap_names[CAP_COUNT] = {
+    "RECV", "UART", "DINFO", "DOMAIN"
+};
+
+static uint8_t esp_caps = 0;
+
+// Loads the capability bitmap from the cache, or probes and saves it when
+// the firmware changed, the cache is missing or 'force' is set (!INIT).
+static void esp_caps_init(uint8_t force)
 {
+    char ver[CAP_VER_LEN + 1];      // Version line + cached bitmap
+    char rec[CAP_VER_LEN + 1];
+    uint8_t h;
     uint8_t i;
     
-    current_attr = ATTR_LOCAL;
-    main_puts("Full initialization.");
+    memset(ver, 0, sizeof(ver));
+    rx_reset_all();
+    esp_send_at("AT+GMR");
+    if (wait_for_string("AT version", FRAMES_1S) && rx_line[0] == 'A') {
+        strncpy(ver, rx_line, CAP_VER_LEN - 1);
+        ver[CAP_VER_LEN - 1] = CAP_COUNT;   // Bit layout of the cached bitmap
+        wait_for_response(FRAMES_1S);   // SDK/compile lines + OK
+    }
+    
+    if (!force && ver[0]) {
+        h = esx_fopen_read(S_CAP_FILE);
+        if (h != 0xFF) {
+            i = (esx_fread(h, rec, sizeof(rec)) == sizeof(rec) &&
+                 memcmp(rec, ver, CAP_VER_LEN) == 0);
+            esx_fclose(h);
+            if (i) {
+                esp_caps = (uint8_t)rec[CAP_VER_LEN];
+                goto caps_apply;
+            }
+        }
+    }
+    
+    // Probe: OK = supported, ERROR = unknown command
+    esp_caps = 0;
+    for (i = 0; i < CAP_COUNT; i++) {
+        if (esp_query(cap_probe[i], NULL, FRAMES_1S / 2)) esp_caps |= (1 << i);
+    }
+    
+    if (ver[0]) {
+        ver[CAP_VER_LEN] = (char)esp_caps;
+        h = esx_fopen_write(S_CAP_FILE);
+        if (h != 0xFF) {
+            esx_fwrite(h, ver, sizeof(ver));
+            esx_fclose(h);
+        }
+    }
+    
+caps_apply:
+    // +IPD without remote IP/port: shorter headers for the demux
+    if (esp_caps & CAP_DINFO) esp_query("AT+CIPDINFO=0", NULL, FRAMES_1S / 2);
+}
+
+// ============================================================================
+// NUEVA INICIALIZACIÓN OPTIMISTA (Estilo espATZX + Lógica FTP)
+// ============================================================================
+
+// 1. Función auxiliar para configurar modo FTP (CIPMUX=1)
+// Se usa tanto en el arranque rápido como en el lento. Sin +++.
+static void setup_ftp_mode(void)
+{
+    esp_init_run(init_steps + 1);
+}
+
+// 2. Inicialización completa (Fallback cuando algo va mal)
+// Esta es la versión robusta que discutimos antes
+static void full_initialization_sequence(void)
+{
+    uint8_t i;
+    
+    current_attr = ATTR_LOCAL;
+    main_puts("Full initialization.");
     main_newline();
 
     // Reset lógico de la comunicación (ATE0, flushes...)
@@ -1996,6 +2665,10 @@ static void full_initialization_sequence(void)
     main_puts("OK");
     main_newline();
     
+    // El firmware puede haber cambiado: volver a sondear capacidades
+    esp_caps_init(1);
+    uart_flow = (esp_caps & CAP_UART_CUR) ? esp_flow_check() : 0;
+    
     current_attr = ATTR_LOCAL;
     main_puts(S_CHECKING);
     main_newline();
@@ -2023,64 +2696,30 @@ static void full_initialization_sequence(void)
 
 static void smart_init(void)
 {
-    uint8_t i;
-    uint16_t frames;
+    uint8_t pass;
 
     current_attr = ATTR_LOCAL;
     main_puts("Initializing.");
 
-    ay_uart_init();
+    uart_speed = BAUD_9600;
+    uart_ferr_mark = 0;
 
-    // Wait for UART to be ready (10 frames = 200ms) - CRITICAL!
-    for (i = 0; i < 10; i++) HALT();
-    
-    uart_flush_rx();
-    
-    // Exit transparent/data mode if stuck
-    uart_send_string("+++");
-    for (i = 0; i < 10; i++) HALT();
-    uart_flush_rx();
-    
-    // Disable echo
-    uart_send_string("ATE0\r\n");
-    for (i = 0; i < 5; i++) HALT();
-    uart_flush_rx();
-    
-    // Stop any TCP server
-    uart_send_string("AT+CIPSERVER=0\r\n");
-    for (i = 0; i < 5; i++) HALT();
-    uart_flush_rx();
-    
-    // Close ALL connections
-    uart_send_string("AT+CIPCLOSE=5\r\n");
-    for (i = 0; i < 5; i++) HALT();
-    uart_flush_rx();
-    
-    // Multi-connection mode (needed for FTP)
-    uart_send_string(S_AT_CIPMUX);
-    for (i = 0; i < 5; i++) HALT();
-    uart_flush_rx();
-    
-    // Test AT
-    uart_send_string("AT\r\n");
-    
-    rx_pos = 0;
-    
-    // Timeout ~3 segundos (150 frames)
-    for (frames = 0; frames < 150; frames++) {
-        HALT();
-        uart_drain_to_buffer();
+    // Normal case: the ESP is already up and answers at once. Only if the
+    // final AT fails, give it the old 1 s settle time (cold power-on)
+    // and repeat the whole sequence once.
+    for (pass = 0; pass < 2; pass++) {
+        if (pass) wait_frames(FRAMES_1S);
+        ay_uart_init();
+        esp_init_run(init_steps);
         
-        if (try_read_line()) {
-            if (rx_line[0] == 'O' && rx_line[1] == 'K') {
-                // Fix color: espacio en verde, OK en azul
-                main_puts(" ");
-                current_attr = ATTR_RESPONSE;
-                main_puts("OK");
-                main_newline();
-                goto esp_ok;
-            }
-            rx_pos = 0;
+        // Test AT - Timeout ~3 segundos (150 frames)
+        if (esp_query("AT", NULL, pass ? 150 : FRAMES_1S)) {
+            // Fix color: espacio en verde, OK en azul
+            main_puts(" ");
+            current_attr = ATTR_RESPONSE;
+            main_puts("OK");
+            main_newline();
+            goto esp_ok;
         }
     }
     
@@ -2094,6 +2733,9 @@ static void smart_init(void)
     return;
 
 esp_ok:
+    esp_caps_init(0);
+    uart_flow = (esp_caps & CAP_UART_CUR) ? esp_flow_check() : 0;
+    
     // Check WiFi
     current_attr = ATTR_LOCAL;
     main_puts(S_CHECKING);
@@ -2152,7 +2794,7 @@ static uint8_t confirm_disconnect(void)
             return 0;
         }
         if (k == 'y' || k == 'Y' || k == 13) break;
-        HALT();  // Procesar interrupciones mientras esperamos
+        rx_wait_frame();  // Drenar el UART mientras esperamos
     }
     
     // User confirmed - disconnect cleanly
@@ -2167,7 +2809,6 @@ static uint8_t confirm_disconnect(void)
     // Close socket
     esp_tcp_close(0);
     rb_flush();
-    rx_pos = 0;
     
     // Reset state
     clear_ftp_state();
@@ -2220,14 +2861,153 @@ static void esp_tcp_close(uint8_t sock)
     wait_for_response(100);  // ~2 segundos
 }
 
+// ============================================================================
+// DNS CACHE (BITSTRM.DNS)
+// ============================================================================
+// AT+CIPSTART con nombre hace que el ESP repita el DNS en cada OPEN. Con
+// AT+CIPDOMAIN resolvemos una vez y conectamos por IP literal. La tabla se
+// guarda en SD; sin reloj, la caducidad se cuenta en arranques: cada carga
+// envejece las entradas y a DNS_MAX_AGE se vuelven a resolver (si el DNS
+// falla se sigue usando la IP vieja). Si la IP rechaza la conexión se
+// olvida y se conecta por nombre.
+
+#define DNS_ENTRIES     4
+#define DNS_MAX_AGE     8     // Boots before a cached address is re-resolved
+
+struct dns_ent {
+    char    host[32];         // Same size as ftp_host
+    char    ip[16];
+    uint8_t age;              // Boots since it was resolved
+};
+
+static const char S_DNS_FILE[] = "BITSTRM.DNS";
+static struct dns_ent dns_tab[DNS_ENTRIES];
+static uint8_t dns_loaded;
+
+static void dns_save(void)
+{
+    uint8_t h = esx_fopen_write(S_DNS_FILE);
+    
+    if (h == 0xFF) return;
+    esx_fwrite(h, dns_tab, sizeof(dns_tab));
+    esx_fclose(h);
+}
+
+// First use in this boot: load the table and age it by one boot
+static void dns_load(void)
+{
+    uint8_t h;
+    uint8_t i;
+    
+    dns_loaded = 1;
+    h = esx_fopen_read(S_DNS_FILE);
+    if (h == 0xFF) return;
+    i = (esx_fread(h, dns_tab, sizeof(dns_tab)) == sizeof(dns_tab));
+    esx_fclose(h);
+    if (!i) {
+        memset(dns_tab, 0, sizeof(dns_tab));
+        return;
+    }
+    for (i = 0; i < DNS_ENTRIES; i++) {
+        if (dns_tab[i].age < 0xFF) dns_tab[i].age++;
+    }
+    dns_save();
+}
+
+static uint8_t is_ip_literal(const char *s)
+{
+    for (; *s; s++) {
+        if ((*s < '0' || *s > '9') && *s != '.') return 0;
+    }
+    return 1;
+}
+
+// AT+CIPDOMAIN="host" -> ip (16 bytes). Accepts +CIPDOMAIN:a.b.c.d with or
+// without quotes. Returns 0 if the lookup failed.
+static uint8_t dns_resolve(const char *host, char *ip)
+{
+    struct deadline dl;
+    char *p;
+    uint8_t n = 0;
+    
+    p = tx_buffer;
+    p = str_append(p, "AT+CIPDOMAIN=\"");
+    p = str_append(p, host);
+    char_append(p, '"');
+    esp_send_at(tx_buffer);
+    
+    deadline_start(&dl, FRAMES_5S);
+    while (!deadline_expired(&dl)) {
+        if (key_edit_down()) return 0;
+        if (!try_read_line()) continue;
+        if (strncmp(rx_line, "+CIPDOMAIN:", 11) == 0) {
+            for (p = rx_line + 11; *p && n < 15; p++) {
+                if ((*p >= '0' && *p <= '9') || *p == '.') ip[n++] = *p;
+            }
+            ip[n] = 0;
+        }
+        if (rx_line[0] == 'O' && rx_line[1] == 'K') return n != 0;
+        if (rx_line[0] == 'E' && rx_line[1] == 'R' && rx_line[2] == 'R') return 0;
+    }
+    return 0;
+}
+
+// Cached or freshly resolved entry for host; NULL = connect by name
+static struct dns_ent *dns_lookup(const char *host)
+{
+    struct dns_ent *e;
+    struct dns_ent *slot = NULL;
+    char ip[16];
+    uint8_t i;
+    
+    if (!(esp_caps & CAP_DOMAIN) || is_ip_literal(host) ||
+        strlen(host) >= sizeof(dns_tab[0].host)) return NULL;
+    if (!dns_loaded) dns_load();
+    
+    // Same host, else an empty slot, else the oldest entry
+    for (i = 0, e = dns_tab; i < DNS_ENTRIES; i++, e++) {
+        if (strcmp(e->host, host) == 0) {
+            if (e->age < DNS_MAX_AGE) return e;
+            slot = e;
+            break;
+        }
+        if (!slot || (slot->host[0] && (!e->host[0] || e->age > slot->age))) slot = e;
+    }
+    
+    if (!dns_resolve(host, ip)) {
+        return (e == slot) ? slot : NULL;   // Stale address beats DNS Fail
+    }
+    safe_copy(slot->host, host, sizeof(slot->host));
+    safe_copy(slot->ip, ip, sizeof(slot->ip));
+    slot->age = 0;
+    dns_save();
+    return slot;
+}
+
+// Control connection by cached IP, falling back to the host name
+static uint8_t dns_connect(const char *host, uint16_t port)
+{
+    struct dns_ent *e = dns_lookup(host);
+    
+    if (e) {
+        if (esp_tcp_connect(0, e->ip, port)) return 1;
+        if (key_edit_down()) return 0;
+        
+        // Refused: forget the address and let the ESP resolve the name
+        e->host[0] = 0;
+        dns_save();
+        esp_tcp_close(0);
+        rb_flush();
+    }
+    return esp_tcp_connect(0, host, port);
+}
+
 static uint8_t esp_tcp_send(uint8_t sock, const char *data, uint16_t len)
 {
     uint16_t i;
-    uint16_t frames;
-    int16_t c;
-    
-    // Limpiamos el parser de respuestas para usarlo como detector de errores
-    rx_pos = 0; 
+    struct deadline dl;
+    uint8_t ev;
+    uint8_t busy = 3;  // "busy" replies tolerated (ESP still closing a link)
     
     {
         char *p = tx_buffer;
@@ -2238,59 +3018,201 @@ static uint8_t esp_tcp_send(uint8_t sock, const char *data, uint16_t len)
     }
     esp_send_at(tx_buffer);
     
-    // CRITICAL FIX: When debug is active, printing to screen takes time.
-    // During that time, ESP sends its response but nobody is draining to ring buffer.
-    // Add small delay + drain to capture bytes that arrived during screen print.
-    wait_frames(2);
-    uart_drain_to_buffer();
-    
-    // Esperar prompt '>' - Timeout ~3 segundos (150 frames)
-    frames = 0;
-    while (frames < 150) {
-        HALT();
-        
+    // Esperar prompt '>' - Timeout ~3 segundos (150 frames). Polling
+    // continuo: el debug ya retiene CTS mientras imprime (main_print).
+    deadline_start(&dl, 150);
+    while (!deadline_expired(&dl)) {
         // Cancelación manual
         if (key_edit_down()) {
             return 0;
         }
         
-        uart_drain_to_buffer();
-        while ((c = rb_pop()) != -1) {
+        while ((ev = dmx_poll()) != DMX_NONE) {
             // 1. ÉXITO: Recibimos el prompt '>'
-            if (c == '>') goto send_data;
+            if (ev == DMX_PROMPT) goto send_data;
+            
+            // Data of another link queued ahead of the prompt: not ours
+            if (ev == DMX_DATA) {
+                if (!dmx_skip()) break;
+                continue;
+            }
             
             // 2. DETECCIÓN DE ERROR RÁPIDA (Fail-Fast)
             // Si el ESP responde ERROR, no tiene sentido esperar 3 segundos.
-            if (c == '\n') {
-                rx_line[rx_pos] = 0;
-                if (strstr(rx_line, "ERROR") || 
-                    strstr(rx_line, "link is not") || 
-                    strstr(rx_line, "CLOSED")) {
-                    return 0; // Abortar inmediatamente
+            if (ev == DMX_CLOSED && dmx_link == sock) return 0;
+            if (ev == DMX_LINE && rx_link == DMX_ESP &&
+                (strstr(rx_line, "ERROR") || strstr(rx_line, "link is not"))) {
+                return 0; // Abortar inmediatamente
+            }
+            
+            // ESP todavía con el comando anterior: repetir en cuanto lo diga
+            if (ev == DMX_LINE && rx_link == DMX_ESP && strncmp(rx_line, "busy", 4) == 0) {
+                if (!busy--) return 0;
+                {
+                    char *p = tx_buffer;
+                    p = str_append(p, "AT+CIPSEND=");
+                    p = u16_to_dec(p, (uint16_t)sock);
+                    p = char_append(p, ',');
+                    p = u16_to_dec(p, len);
                 }
-                rx_pos = 0;
-            } else if (c != '\r' && rx_pos < 120) {
-                rx_line[rx_pos++] = (char)c;
+                esp_send_at(tx_buffer);
             }
         }
-        frames++;
     }
     return 0;  // Timeout real (si el ESP no responde nada)
     
 send_data:
-    // Pequeño retardo técnico post-prompt
-    
-    // Enviar datos crudos
+    // Enviar datos crudos. "SEND OK" llega después como línea del ESP y la
+    // descarta quien lea a continuación: sin espera fija tras el envío.
     for (i = 0; i < len; i++) {
         ay_uart_send(data[i]);
     }
-    
-    // Breve espera para asegurar que el buffer de salida se vacíe antes de seguir
-    wait_frames(2);
+    if (sock == 0) rtt_arm();
     
     return 1;
 }
 
+// ============================================================================
+// PASSIVE RECEIVE (AT+CIPRECVMODE=1)
+// ============================================================================
+// The ESP keeps socket data in its own buffer and only announces it with
+// "+IPD,<link>,<len>" (no payload). We pull it with AT+CIPRECVDATA when we
+// have room, so nothing is lost while the Spectrum writes to SD.
+// The mode is global: while it is on, control replies must be pulled too.
+
+#define PULL_UNKNOWN    0
+#define PULL_OK         1
+#define PULL_NONE       2         // Firmware lacks CIPRECVMODE: push only
+
+#define PULL_SILENCE    FRAMES_1S // Frames without a byte inside a reply
+#define PULL_CHUNK      WR_HALF   // Bytes asked per AT+CIPRECVDATA (fits the ring)
+#define RECV_ERROR      0xFFFF
+
+static uint8_t  esp_pull = PULL_UNKNOWN;
+static uint16_t pull_pending[DATA_LINK_LAST + 1];  // Bytes announced per link (0 ctrl)
+static uint8_t  pull_closed = 0;  // Bit n set: "n,CLOSED" seen
+static uint8_t  pull_file;        // Handle for esp_tcp_recv(..., NULL, ...)
+
+static const char S_CIPRECVDATA[] = "+CIPRECVDATA";
+
+static uint8_t esp_recv_mode(uint8_t pull)
+{
+    rx_reset_all();
+    esp_send_at(pull ? "AT+CIPRECVMODE=1" : "AT+CIPRECVMODE=0");
+    if (pull) {
+        memset(pull_pending, 0, sizeof(pull_pending));
+        pull_closed = 0;
+    }
+    return wait_for_response(FRAMES_1S);
+}
+
+// Unsolicited lines seen in passive mode: "+IPD,<link>,<len>" / "<link>,CLOSED"
+static void pull_note_line(const char *line)
+{
+    char *p;
+    uint8_t link;
+    
+    if (strncmp(line, "+IPD,", 5) == 0) {
+        link = line[5] - '0';
+        if (link <= DATA_LINK_LAST && line[6] == ',') {
+            p = (char *)line + 7;
+            pull_pending[link] = parse_decimal(&p);
+        }
+    } else if (line[0] >= '0' && line[0] <= '4' && line[1] == ',' &&
+               strncmp(line + 2, "CLOSED", 6) == 0) {
+        pull_closed |= (uint8_t)(1 << (line[0] - '0'));
+    }
+}
+
+// Pulls up to max bytes of link sock into buf (passive mode only).
+// Reply is "+CIPRECVDATA,<n>:<data>" (AT 1.x) or "+CIPRECVDATA:<n>,<data>"
+// (AT 2.x, CIPDINFO off), then OK. Notifications seen meanwhile are noted.
+// Returns bytes copied (0 = nothing buffered) or RECV_ERROR.
+static uint16_t esp_tcp_recv(uint8_t sock, uint8_t *buf, uint16_t max)
+{
+    char hdr[24];
+    uint8_t hdr_pos = 0;
+    uint8_t phase = 0;      // 0 header, 1 payload, 2 trailing OK
+    uint16_t n = 0;
+    uint16_t got = 0;
+    uint16_t w;
+    struct deadline silence;
+    int16_t c;
+    char *p;
+    
+    {
+        char *q = tx_buffer;
+        q = str_append(q, "AT+CIPRECVDATA=");
+        q = u16_to_dec(q, (uint16_t)sock);
+        q = char_append(q, ',');
+        q = u16_to_dec(q, max);
+    }
+    esp_send_at(tx_buffer);
+    
+    // Take over any ESP text the demux had half-read
+    hdr_pos = dmx_hdr_pos < sizeof(hdr) - 1 ? dmx_hdr_pos : sizeof(hdr) - 1;
+    memcpy(hdr, dmx_hdr, hdr_pos);
+    dmx_hdr_pos = 0;
+    
+    deadline_start(&silence, PULL_SILENCE);
+    while (!deadline_expired(&silence)) {
+        uart_drain_to_buffer();
+        
+        // buf == NULL: payload goes to pull_file straight from ring spans,
+        // in one go once complete: the ESP sends nothing more until asked
+        if (phase == 1 && !buf) {
+            w = (rb_head - rb_tail) & 0x1FF;
+            if (w < n - got && w < WR_FORCE) continue;
+            got += rb_write(pull_file, w < n - got ? w : n - got);
+            deadline_restart(&silence);
+            if (got == n) { phase = 2; hdr_pos = 0; }
+            continue;
+        }
+        
+        c = rb_pop();
+        if (c == -1) continue;
+        deadline_restart(&silence);
+        
+        if (phase == 1) {
+            buf[got++] = (uint8_t)c;
+            if (got == n) { phase = 2; hdr_pos = 0; }
+            continue;
+        }
+        
+        if (c == '\r') continue;
+        if (c == '\n') {
+            hdr[hdr_pos] = 0;
+            if (phase == 2 && hdr[0] == 'O' && hdr[1] == 'K') break;
+            if (strncmp(hdr, "ERROR", 5) == 0) { got = RECV_ERROR; break; }
+            pull_note_line(hdr);
+            hdr_pos = 0;
+            continue;
+        }
+        
+        if (phase == 0 && (c == ':' || c == ',') && hdr_pos > 13 &&
+            strncmp(hdr, S_CIPRECVDATA, 12) == 0) {
+            hdr[hdr_pos] = 0;
+            p = hdr + 13;
+            n = parse_decimal(&p);
+            if (n > max) n = max;
+            phase = n ? 1 : 2;
+            hdr_pos = 0;
+            continue;
+        }
+        
+        if (hdr_pos < sizeof(hdr) - 1) hdr[hdr_pos++] = (char)c;
+    }
+    
+    if (phase < 2) got = RECV_ERROR;   // Timeout before the payload ended
+    
+    // A full chunk may leave more behind even if the announced total said no
+    if (got == RECV_ERROR || got == 0) pull_pending[sock] = 0;
+    else if (pull_pending[sock] > got) pull_pending[sock] -= got;
+    else pull_pending[sock] = (got == max);
+    
+    return got;
+}
+
 // ============================================================================
 // QUICK CONTROL-CHANNEL PROBE (LOW COST)
 // ============================================================================
@@ -2298,7 +3220,7 @@ send_data:
 // Returns 1 if a 2xx reply is observed, else 0.
 static uint8_t quick_noop_check(uint16_t max_frames)
 {
-    uint16_t frames = 0;
+    struct deadline dl;
 
     // If we are not in an FTP-connected state, nothing to probe.
     if (connection_state < STATE_FTP_CONNECTED) {
@@ -2311,12 +3233,11 @@ static uint8_t quick_noop_check(uint16_t max_frames)
     }
 
     // Wait for a short, bounded time for any 2xx response line.
-    while (frames < max_frames) {
-        HALT();
-        uart_drain_to_buffer();
+    deadline_start(&dl, max_frames);
+    while (!deadline_expired(&dl)) {
         if (try_read_line()) {
             // Accept any 2xx (200, 220, 221, etc.) as a positive liveness signal
-            if (rx_line[0] == '2' && rx_line[1] >= '0' && rx_line[1] <= '9' && rx_line[2] >= '0' && rx_line[2] <= '9') {
+            if (rx_link == 0 && rx_line[0] == '2' && rx_line[1] >= '0' && rx_line[1] <= '9' && rx_line[2] >= '0' && rx_line[2] <= '9') {
                 return 1;
             }
             // If we explicitly see CLOSED, treat as dead
@@ -2324,7 +3245,6 @@ static uint8_t quick_noop_check(uint16_t max_frames)
                 return 0;
             }
         }
-        frames++;
     }
 
     return 0;
@@ -2365,72 +3285,159 @@ static uint16_t parse_decimal(char **pp)
     return val;
 }
 
-static uint16_t ftp_passive(void)
+// "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)" -> data_ip, data_port.
+// Returns the port, 0 if the line is not a usable 227.
+static uint16_t ftp_parse_227(char *p)
 {
     uint16_t p1, p2;
-    char *p;
     uint8_t i;
     uint8_t octets[4];
-    uint16_t frames = 0;
+    
+    if (strncmp(p, "227", 3) != 0) return 0;
+    p = strchr(p, '(');
+    if (!p) return 0;
+    p++;
+    for (i = 0; i < 4; i++) {
+        octets[i] = (uint8_t)parse_decimal(&p);
+        if (*p == ',') p++;
+    }
+    {
+        char *q = data_ip;
+        q = u16_to_dec(q, (uint16_t)octets[0]);
+        q = char_append(q, '.');
+        q = u16_to_dec(q, (uint16_t)octets[1]);
+        q = char_append(q, '.');
+        q = u16_to_dec(q, (uint16_t)octets[2]);
+        q = char_append(q, '.');
+        q = u16_to_dec(q, (uint16_t)octets[3]);
+    }
+    
+    p1 = parse_decimal(&p);
+    if (*p == ',') p++;
+    p2 = parse_decimal(&p);
+    
+    data_port = (p1 << 8) | p2;
+    return data_port;
+}
+
+static uint16_t ftp_passive(void)
+{
+    struct deadline dl;
     
     if (!ftp_command("PASV")) {
         main_print("[PASV send fail]");
         return 0;
     }
     
-    rx_pos = 0;
-    
     // Timeout ~5 segundos (250 frames)
-    while (frames < 250) {
-        HALT();
-        
+    deadline_start(&dl, rtt_timeout(250));
+    while (!deadline_expired(&dl)) {
         if (key_edit_down()) {
             main_print(S_CANCEL);
             return 0;
         }
         
-        uart_drain_to_buffer();
-        
         if (try_read_line()) {
-            if (strncmp(rx_line, S_IPD0, 7) == 0) {
-                p = strchr(rx_line, ':');
-                if (p && strstr(p, "227")) {
-                    p = strchr(p, '(');
-                    if (p) {
-                        p++;
-                        for (i = 0; i < 4; i++) {
-                            octets[i] = (uint8_t)parse_decimal(&p);
-                            if (*p == ',') p++;
-                        }
-                        {
-                            char *q = data_ip;
-                            q = u16_to_dec(q, (uint16_t)octets[0]);
-                            q = char_append(q, '.');
-                            q = u16_to_dec(q, (uint16_t)octets[1]);
-                            q = char_append(q, '.');
-                            q = u16_to_dec(q, (uint16_t)octets[2]);
-                            q = char_append(q, '.');
-                            q = u16_to_dec(q, (uint16_t)octets[3]);
-                        }
-                        
-                        p1 = parse_decimal(&p);
-                        if (*p == ',') p++;
-                        p2 = parse_decimal(&p);
-                        
-                        data_port = (p1 << 8) | p2;
-                        
-                        return data_port;
-                    }
-                }
-            }
-            rx_pos = 0;
+            if (rx_link == 0 && ftp_parse_227(rx_line)) return data_port;
         }
-        frames++;
     }
     main_print("[PASV timeout]");
     return 0;
 }
 
+// ============================================================================
+// CONTROL PIPELINE
+// ============================================================================
+// Varios comandos FTP en un solo AT+CIPSEND: el servidor los contesta en
+// orden, así que basta contar las respuestas finales que se deben.
+// SIZE y PASV de una descarga viajan juntos, y en un lote los del fichero
+// siguiente salen en cuanto termina el actual, detrás de su 226.
+
+#define PIPE_MAX        4
+
+static uint8_t pipe_owed = 0;     // Final replies still to come, in order
+static char    pipe_next[sizeof(ftp_cmd_buffer)];  // Remote whose SIZE+PASV are in flight
+static uint8_t pipe_drop = 0;     // Transfer reply (226) still due ahead of them
+static const char *dl_next = NULL;  // Next file of the batch (prefetch)
+
+// Send cmds ("CMD\r\n" each) in one CIPSEND; n = final replies they produce
+static uint8_t pipe_send(const char *cmds, uint8_t n)
+{
+    if (pipe_owed + n > PIPE_MAX) return 0;
+    if (!esp_tcp_send(0, cmds, strlen(cmds))) return 0;
+    pipe_owed += n;
+    return 1;
+}
+
+// Next final reply in rx_line: 2xx-5xx, skipping 1xx and the continuation
+// lines of multi-line replies. Returns its code, 0 on timeout or EDIT
+// (the pipeline is then out of step and forgotten).
+static uint16_t pipe_reply(uint16_t frames)
+{
+    struct deadline dl;
+    char *p;
+    uint16_t code;
+    
+    deadline_start(&dl, rtt_timeout(frames));
+    while (pipe_owed && !deadline_expired(&dl)) {
+        if (key_edit_down()) break;
+        if (!try_read_line() || rx_link != 0) continue;
+        if (rx_line[0] < '2' || rx_line[0] > '5' || rx_line[3] != ' ') continue;
+        p = rx_line;
+        code = parse_decimal(&p);
+        // Late end-of-transfer reply (ftp_wait_done timed out): not ours
+        if (pipe_drop) {
+            pipe_drop = 0;
+            if (code == 226 || code == 250 || code == 426 || code == 451) continue;
+        }
+        pipe_owed--;
+        return code;
+    }
+    pipe_owed = 0;
+    pipe_next[0] = 0;
+    return 0;
+}
+
+// Command batch: ftp_batch_begin, one ftp_batch_add per command (each
+// produces one final reply), ftp_batch_send. Built in ftp_cmd_buffer and
+// sent as one CIPSEND; replies are then read in order with pipe_reply.
+static char   *batch_pos;
+static uint8_t batch_n;
+
+static void ftp_batch_begin(void)
+{
+    batch_pos = ftp_cmd_buffer;
+    batch_n = 0;
+}
+
+// "cmd[arg]\r\n". Returns 0 if it does not fit.
+static uint8_t ftp_batch_add(const char *cmd, const char *arg)
+{
+    uint16_t len = strlen(cmd) + (arg ? strlen(arg) : 0) + 2;
+    
+    if ((batch_pos - ftp_cmd_buffer) + len >= sizeof(ftp_cmd_buffer)) return 0;
+    batch_pos = str_append(batch_pos, cmd);
+    if (arg) batch_pos = str_append(batch_pos, arg);
+    batch_pos = str_append(batch_pos, S_CRLF);
+    batch_n++;
+    return 1;
+}
+
+static uint8_t ftp_batch_send(void)
+{
+    return batch_n && pipe_send(ftp_cmd_buffer, batch_n);
+}
+
+// SIZE + PASV for remote in one CIPSEND
+static uint8_t pipe_size_pasv(const char *remote)
+{
+    ftp_batch_begin();
+    if (!ftp_batch_add("SIZE ", remote) || !ftp_batch_add("PASV", NULL)) return 0;
+    if (!ftp_batch_send()) return 0;
+    safe_copy(pipe_next, remote, sizeof(pipe_next));
+    return 1;
+}
+
 static uint8_t ftp_open_data(void)
 {
     uint8_t result;
@@ -2439,26 +3446,40 @@ static uint8_t ftp_open_data(void)
         return 0;
     }
         
-    result = esp_tcp_connect(1, data_ip, data_port);
+    // Next link in the rotation: the previous one may still be closing
+    data_link = (data_link == DATA_LINK_LAST) ? DATA_LINK_FIRST : data_link + 1;
+    dmx_closed &= (uint8_t)~(1 << data_link);
+    result = esp_tcp_connect(data_link, data_ip, data_port);
      
     return result;
 }
 
 static void ftp_close_data(void)
 {
-    // Cierra el socket de datos (que es el 1 según ftp_open_data)
-    esp_tcp_close(1);
-    
-    // Esperar y drenar datos residuales que puedan llegar
-    // después de cerrar el socket
-    uint16_t i;
-    for (i = 0; i < 25; i++) {
-        HALT();
-        uart_drain_to_buffer();
+    // Cerrado ya por el servidor ("n,CLOSED"): nada que pedir al ESP.
+    // Si no, CIPCLOSE espera solo a su OK. Lo que aún llegue por este
+    // enlace lo descarta el demux: el siguiente PASV usa otro enlace.
+    if (!((dmx_closed | pull_closed) & (uint8_t)(1 << data_link))) {
+        esp_tcp_close(data_link);
     }
+    dmx_skip();  // Payload of this link already in the ring
+}
+
+// Respuesta final del canal de control tras una transferencia (226, o el
+// error que la sustituya). Sustituye a las esperas fijas entre ficheros.
+// Devuelve 0 si no llegó a tiempo: la respuesta sigue pendiente (pipe_drop).
+static uint8_t ftp_wait_done(void)
+{
+    struct deadline dl;
+    uint8_t ev;
     
-    // Vaciar el ring buffer para descartar datos residuales
-    rb_flush();
+    deadline_start(&dl, rtt_timeout(SILENCE_NORMAL));
+    while (!deadline_expired(&dl)) {
+        ev = dmx_poll();
+        if (ev == DMX_DATA) dmx_skip();
+        else if (ev == DMX_LINE && rx_link == 0 && rx_line[0] >= '2' && rx_line[0] <= '5') return 1;
+    }
+    return 0;
 }
 
 // Setup PASV + data connection + send LIST command
@@ -2485,61 +3506,35 @@ static uint8_t setup_list_transfer(void)
     
     // Wait for "150 Opening data connection" response
     // This is critical - without it, we start reading before server sends data
-    uint16_t frames = 0;
-    char resp_buf[64];
-    uint8_t resp_pos = 0;
-    int16_t c;
+    struct deadline dl;
+    uint8_t ev;
     
-    while (frames < 200) {  // ~4 segundos
-        uart_drain_to_buffer();
-        c = rb_pop();
+    deadline_start(&dl, rtt_timeout(200));
+    while (!deadline_expired(&dl)) {  // ~4 segundos
+        ev = dmx_poll();
         
-        if (c == -1) {
-            HALT();
+        if (ev == DMX_NONE) {
             if (key_edit_down()) {
                 ftp_close_data();
                 fail(S_CANCEL);
                 return 0;
             }
-            frames++;
             continue;
         }
         
-        if (c == '\r') continue;
+        // Early data: it stays in the ring for cmd_list_core
+        if (ev == DMX_DATA) return 1;
         
-        if (c == '\n') {
-            resp_buf[resp_pos] = 0;
-            
-            // Check for "150" or "125" response on control channel
-            if (strncmp(resp_buf, "+IPD,0,", 7) == 0) {
-                if (strstr(resp_buf, "150") || strstr(resp_buf, "125")) {
-                    // Server confirmed - data will start coming
-                    wait_frames(5);  // Small delay for data to arrive
-                    return 1;
-                }
-                if (strstr(resp_buf, "550") || strstr(resp_buf, "226")) {
-                    // Error or empty directory
-                    ftp_close_data();
-                    return 1;  // Continue anyway, let cmd_list_core handle it
-                }
+        // Check for "150" or "125" response on control channel
+        if (ev == DMX_LINE && rx_link == 0) {
+            if (strncmp(rx_line, "150", 3) == 0 || strncmp(rx_line, "125", 3) == 0) {
+                return 1;  // Server confirmed - data will start coming
             }
-            
-            // Check if data channel is already sending (early data)
-            if (strncmp(resp_buf, "+IPD,1,", 7) == 0) {
-                // Data arriving - flush this line and let cmd_list_core handle it
-                while (c != '\n' && c != -1) {
-                    c = rb_pop();
-                    if (c == -1) break;
-                }
-                return 1;
+            if (strncmp(rx_line, "550", 3) == 0 || strncmp(rx_line, "226", 3) == 0) {
+                // Error or empty directory
+                ftp_close_data();
+                return 1;  // Continue anyway, let cmd_list_core handle it
             }
-            
-            resp_pos = 0;
-            continue;
-        }
-        
-        if (resp_pos < sizeof(resp_buf) - 1) {
-            resp_buf[resp_pos++] = (char)c;
         }
     }
     
@@ -2582,6 +3577,35 @@ static uint8_t esx_fopen_write(const char *filename)
     __endasm;
 }
 
+// Open an existing file for read/write without truncating (resume)
+static uint8_t esx_fopen_rw(const char *filename)
+{
+    (void)filename;
+    __asm
+        ld hl, 2
+        add hl, sp
+        ld hl, (hl)
+        push hl             ; Save for IX
+        
+        xor a
+        rst 0x08
+        defb 0x89           ; ESX_GETSETDRV
+        pop ix              ; IX = filename
+        jr c, esx_rw_fail
+        
+        ld b, 0x03          ; FA_READ | FA_WRITE, open existing
+        rst 0x08
+        defb 0x9A           ; ESX_FOPEN
+        jr c, esx_rw_fail
+        ld l, a
+        jr esx_rw_done
+    esx_rw_fail:
+        ld l, 255
+    esx_rw_done:
+        ld h, 0
+    __endasm;
+}
+
 // Global variables for esxDOS operations (avoid stack parameter issues)
 static uint8_t esx_handle;
 static void *esx_buffer;
@@ -2593,6 +3617,7 @@ static uint16_t esx_fwrite(uint8_t handle, void *buf, uint16_t len)
     esx_buffer = buf;
     esx_length = len;
     
+    cts_hold();  // SD write is long and runs with the UART unattended
     __asm
         ld a, (_esx_handle)
         ld hl, (_esx_buffer)
@@ -2609,6 +3634,136 @@ static uint16_t esx_fwrite(uint8_t handle, void *buf, uint16_t len)
     esx_write_fail:
         ld hl, 0
     esx_write_done:
+        ld (_esx_length), hl
+    __endasm;
+    cts_release();
+    return esx_length;
+}
+
+static uint16_t esx_fread(uint8_t handle, void *buf, uint16_t len)
+{
+    esx_handle = handle;
+    esx_buffer = buf;
+    esx_length = len;
+    
+    cts_hold();
+    __asm
+        ld a, (_esx_handle)
+        ld hl, (_esx_buffer)
+        push hl
+        pop ix              ; IX = buffer address
+        ld bc, (_esx_length)
+        rst 0x08
+        defb 0x9D           ; ESX_FREAD
+        jr c, esx_read_fail
+        ; BC = bytes read (0 at EOF)
+        ld h, b
+        ld l, c
+        jr esx_read_done
+    esx_read_fail:
+        ld hl, 0
+    esx_read_done:
+        ld (_esx_length), hl
+    __endasm;
+    cts_release();
+    return esx_length;
+}
+
+// Global position for seek/truncate (BCDE in esxDOS)
+static uint32_t esx_pos;
+
+// Seek from the start of the file. Returns 1 on success.
+static uint8_t esx_fseek(uint8_t handle, uint32_t pos)
+{
+    esx_handle = handle;
+    esx_pos = pos;
+    
+    __asm
+        ld a, (_esx_handle)
+        ld de, (_esx_pos)
+        ld bc, (_esx_pos + 2)
+        ld ixl, 0           ; SEEK_SET
+        rst 0x08
+        defb 0x9F           ; ESX_FSEEK
+        sbc a, a            ; 0xFF on error
+        inc a
+        ld l, a
+        ld h, 0
+        ld (_esx_length), hl
+    __endasm;
+    return (uint8_t)esx_length;
+}
+
+// File size from ESX_FSTAT (size is the last field of the 11-byte record)
+static uint32_t esx_fsize(uint8_t handle)
+{
+    uint8_t st[11];
+    
+    memset(st, 0, sizeof(st));
+    esx_handle = handle;
+    esx_buffer = st;
+    __asm
+        ld a, (_esx_handle)
+        ld hl, (_esx_buffer)
+        push hl
+        pop ix              ; IX = stat buffer
+        rst 0x08
+        defb 0xA1           ; ESX_FSTAT
+    __endasm;
+    return *(uint32_t *)&st[7];
+}
+
+// Cut the file at pos. Returns 1 on success (0 on esxDOS builds without it).
+static uint8_t esx_ftruncate(uint8_t handle, uint32_t pos)
+{
+    esx_handle = handle;
+    esx_pos = pos;
+    
+    __asm
+        ld a, (_esx_handle)
+        ld de, (_esx_pos)
+        ld bc, (_esx_pos + 2)
+        rst 0x08
+        defb 0xA2           ; ESX_FTRUNCATE
+        sbc a, a
+        inc a
+        ld l, a
+        ld h, 0
+        ld (_esx_length), hl
+    __endasm;
+    return (uint8_t)esx_length;
+}
+
+// Extiende el fichero a su tamaño final escribiendo el último byte: la
+// cadena FAT se reserva ya y un disco lleno falla aquí, no a mitad de descarga.
+// Deja el puntero en pos (0, o el punto de reanudación).
+static uint8_t esx_prealloc(uint8_t handle, uint32_t size, uint32_t pos)
+{
+    uint8_t z = 0;
+    
+    if (pos < size) {
+        if (!esx_fseek(handle, size - 1)) return 0;
+        if (esx_fwrite(handle, &z, 1) != 1) return 0;
+    }
+    return esx_fseek(handle, pos);
+}
+
+static void esx_unlink(const char *filename)
+{
+    (void)filename;
+    __asm
+        ld hl, 2
+        add hl, sp
+        ld hl, (hl)
+        push hl
+        xor a
+        rst 0x08
+        defb 0x89           ; ESX_GETSETDRV
+        pop ix              ; IX = filename
+        jr c, esx_unlink_done
+        rst 0x08
+        defb 0xAD           ; ESX_UNLINK
+    esx_unlink_done:
     __endasm;
 }
 
@@ -2629,19 +3784,70 @@ static void esx_fclose(uint8_t handle)
     __endasm;
 }
 
+// ============================================================================
+// WRITE-BEHIND BUFFER (128K)
+// ============================================================================
+// En 128K las descargas se acumulan en el banco 1 y van a la SD en bloques
+// de 8 KB (16 sectores): una ESX_FWRITE por bloque en vez de una por media
+// ring. Los bloques completos empiezan siempre en offset múltiplo de 8 KB.
+// En 48K (o 128K bloqueado en modo 48K) file_write es esx_fwrite tal cual.
+
+#define WB_SIZE 8192
+
+static uint8_t  wb_ok = 0;     // bank_detect() at startup
+static uint16_t wb_fill = 0;   // Bytes waiting in bank 1
+
+// Write what is waiting in bank 1. Returns 0 if the SD took less.
+static uint8_t wb_flush(uint8_t handle)
+{
+    uint16_t n;
+    
+    if (!wb_fill) return 1;
+    cts_hold();  // Long SD write, same as esx_fwrite
+    n = bank_fwrite(handle, wb_fill);
+    cts_release();
+    n = (n == wb_fill);
+    wb_fill = 0;
+    return (uint8_t)n;
+}
+
+static uint16_t file_write(uint8_t handle, void *buf, uint16_t len)
+{
+    uint16_t n;
+    uint16_t total = 0;
+    uint8_t *src = (uint8_t *)buf;
+    
+    if (!wb_ok) return esx_fwrite(handle, buf, len);
+    
+    while (len) {
+        n = WB_SIZE - wb_fill;
+        if (n > len) n = len;
+        bank_put(src, wb_fill, n);
+        wb_fill += n;
+        src += n;
+        len -= n;
+        total += n;
+        if (wb_fill == WB_SIZE && !wb_flush(handle)) break;
+    }
+    return total;
+}
+
 
 // ============================================================================
 // COMMAND HANDLERS
 // ============================================================================
 
 static void cmd_pwd(void); 
-static void cmd_pwd_silent(void);
-static void cmd_cd(const char *path);
+static uint8_t cmd_cd(const char *path);
+static void cmd_keepalive(const char *arg);
 
 // ============================================================================
 // CMD_OPEN MODIFICADO (Soporte para Puertos)
 // ============================================================================
 
+static uint8_t session_recover(void);
+static uint8_t mirror_connect(const char *user, const char *pass, const char *skip);
+
 static uint8_t ensure_logged_in(void)
 {
     // Primero verificar si hay mensajes de desconexión pendientes
@@ -2650,17 +3856,19 @@ static uint8_t ensure_logged_in(void)
         uart_drain_to_buffer();
         while (try_read_line()) {
             if (check_disconnect_message()) {
-                clear_ftp_state();
+                session_lost();
                 draw_status_bar();
                 fail("Connection lost");
-                return 0;
+                break;
             }
-            rx_pos = 0;
         }
     }
     
     // Si ya estamos logueados, todo perfecto
     if (connection_state == STATE_LOGGED_IN) return 1;
+    
+    // Sesión perdida: reconectar y seguir con el comando
+    if (connection_state == STATE_WIFI_OK && sess_host[0]) return session_recover();
 
     // Si no, mostramos el error adecuado
     if (connection_state == STATE_DISCONNECTED || connection_state == STATE_WIFI_OK) {
@@ -2708,6 +3916,30 @@ static uint16_t parse_host_port_path(char *input, char **out_host, char **out_pa
     return port;
 }
 
+#define BANNER_OK       0
+#define BANNER_REJECTED 1
+#define BANNER_CANCEL   2
+#define BANNER_TIMEOUT  3
+
+// Espera el saludo 220 en el link 0 (~7 s)
+static uint8_t ftp_wait_banner(void)
+{
+    struct deadline dl;
+    
+    deadline_start(&dl, 350);
+    while (!deadline_expired(&dl)) {
+        if (key_edit_down()) return BANNER_CANCEL;
+        
+        if (try_read_line()) {
+            if (rx_link == 0 && strncmp(rx_line, "220", 3) == 0) return BANNER_OK;
+            if (strstr(rx_line, "CLOSED") || strstr(rx_line, "ERROR") || strstr(rx_line, "421")) {
+                return BANNER_REJECTED;
+            }
+        }
+    }
+    return BANNER_TIMEOUT;
+}
+
 static void cmd_open(const char *host, uint16_t port)
 {
     // 1. Confirmar desconexión si es necesario
@@ -2736,7 +3968,7 @@ static void cmd_open(const char *host, uint16_t port)
     debug_enabled = 0;
     
     // 4. TCP Connect
-    if (!esp_tcp_connect(0, host, port)) {
+    if (!dns_connect(host, port)) {
         debug_enabled = 1;
         esp_tcp_close(0);
         wait_frames(2);
@@ -2745,153 +3977,69 @@ static void cmd_open(const char *host, uint16_t port)
         return;
     }
     
+    rtt_reset();
     current_attr = ATTR_LOCAL;
     main_print("Waiting for banner.");
     drain_mode_fast(); 
     wait_drain(5);
-    rx_pos = 0;
     
     // 5. Espera de Banner
-    uint16_t frames;
-    for (frames = 0; frames < 350; frames++) {
-        HALT();
-        if (key_edit_down()) {
-            debug_enabled = 1;
-            esp_tcp_close(0);
-            fail(S_CANCEL);
-            return;
-        }
-        uart_drain_to_buffer();
-
-        if (try_read_line()) {
-            if (strstr(rx_line, "220")) {
-                debug_enabled = 1;
-                safe_copy(ftp_host, host, sizeof(ftp_host));
-                safe_copy(ftp_user, S_EMPTY, sizeof(ftp_user));
-                
-                connection_state = STATE_FTP_CONNECTED;
-                current_attr = ATTR_RESPONSE;
-                if (main_col > 0) main_newline();
-                main_print("Connected!");
-                draw_status_bar(); // Mostrará FTP: host, USER: ---, PWD: ---
-                return;
-            }
-            
-            if (strstr(rx_line, "CLOSED") || strstr(rx_line, "ERROR") || strstr(rx_line, "421")) {
-                debug_enabled = 1;
-                esp_tcp_close(0);
-                rx_reset_all();
-                main_newline();
-                fail("Connection rejected");
-                return;
-            }
-            rx_pos = 0;
-        }
-    }
-    
+    uint8_t banner = ftp_wait_banner();
     debug_enabled = 1;
-    fail("No FTP banner (timeout)");
-    esp_tcp_close(0);
-    rx_reset_all();
-}
-
-// Wait for FTP response code (like 331, 230, 530)
-// Returns: FTP code (0 if timeout or cancelled)
-static uint16_t user_wait_ftp_response(void)
-{
-    uint16_t frames = 0;
-    uint16_t code = 0;
-    char *p;
-    
-    rx_pos = 0;
     
-    while (frames < 200) {
-        HALT();
-        
-        if (key_edit_down()) {
-            fail(S_CANCEL);
-            return 0;
-        }
-        
-        uart_drain_to_buffer();
+    if (banner == BANNER_OK) {
+        safe_copy(ftp_host, host, sizeof(ftp_host));
+        safe_copy(ftp_user, S_EMPTY, sizeof(ftp_user));
+        ftp_port = port;
         
-        if (try_read_line()) {
-            // Buscamos código de respuesta FTP
-            if (strncmp(rx_line, S_IPD0, 7) == 0) {
-                p = strchr(rx_line, ':');
-                if (p) {
-                    p++;
-                    code = 0;
-                    if (*p >= '1' && *p <= '5') {
-                        code = (*p++ - '0') * 100;
-                        if (*p >= '0' && *p <= '9') code += (*p++ - '0') * 10;
-                        if (*p >= '0' && *p <= '9') code += (*p++ - '0');
-                    }
-                    if (code > 0) return code;
-                }
-            }
-            rx_pos = 0;
-        }
-        frames++;
+        connection_state = STATE_FTP_CONNECTED;
+        current_attr = ATTR_RESPONSE;
+        if (main_col > 0) main_newline();
+        main_print("Connected!");
+        draw_status_bar(); // Mostrará FTP: host, USER: ---, PWD: ---
+        return;
     }
     
-    return 0; // Timeout
+    esp_tcp_close(0);
+    if (banner == BANNER_CANCEL) {
+        fail(S_CANCEL);
+        return;
+    }
+    rx_reset_all();
+    if (banner == BANNER_REJECTED) {
+        main_newline();
+        fail("Connection rejected");
+    } else {
+        fail("No FTP banner (timeout)");
+    }
 }
 
-// Fast FTP code wait - exits immediately on match
-static uint8_t wait_for_ftp_code_fast(uint16_t max_frames, const char *code3)
+// '257 "<path>"' -> ftp_path. Returns 0 if the line has no quoted path.
+static uint8_t pwd_store(char *line)
 {
-    uint16_t frames = 0;
-    char *p;
-    
-    rx_pos = 0;
-    
-    while (frames < max_frames) {
-        HALT();
-        
-        if (key_edit_down()) {
-            return 0;
-        }
-        
-        uart_drain_to_buffer();
-        
-        while (try_read_line()) {
-            if (strncmp(rx_line, S_IPD0, 7) == 0) {
-                p = strchr(rx_line, ':');
-                if (p) {
-                    p++;
-                    // Check if matches expected code
-                    if (p[0] == code3[0] && p[1] == code3[1] && p[2] == code3[2]) {
-                        // Handle multiline: "200-" continues, "200 " ends
-                        if (p[3] == '-') {
-                            continue; // Wait for terminator
-                        }
-                        return 1; // Success - immediate exit
-                    }
-                }
-            }
-            rx_pos = 0;
-        }
-        frames++;
-    }
-    
-    return 0; // Timeout
+    char *start = strchr(line, '"');
+    char *end;
+    
+    if (!start) return 0;
+    start++;
+    end = strchr(start, '"');
+    if (end) *end = 0;
+    safe_copy(ftp_path, start, sizeof(ftp_path));
+    draw_status_bar_real();
+    return 1;
 }
 
-// Core function for PWD - shared by cmd_pwd() and cmd_pwd_silent()
+// Core function for PWD
 static void pwd_core(uint8_t silent)
 {
     if (!ensure_logged_in()) return;    
-    uint16_t frames = 0;
+    struct deadline dl;
     
     if (!ftp_command("PWD")) return;
     
-    rx_pos = 0;
-    
     // Timeout ~4 segundos
-    while (frames < 200) {
-        HALT();
-        
+    deadline_start(&dl, rtt_timeout(200));
+    while (!deadline_expired(&dl)) {
         if (key_edit_down()) {
             if (!silent) {
                 fail(S_CANCEL);
@@ -2899,40 +4047,18 @@ static void pwd_core(uint8_t silent)
             return;
         }
         
-        uart_drain_to_buffer();
-        
         if (try_read_line()) {
-            if (strncmp(rx_line, "+IPD,0,", 7) == 0) {
-                char *start = strchr(rx_line, '"');
-                if (start) {
-                    start++;
-                    char *end = strchr(start, '"');
-                    if (end) *end = 0;
-                    
-                    // Guardar path
-                    safe_copy(ftp_path, start, sizeof(ftp_path));
-                    
-                    // Si no es silencioso, imprimir
-                    if (!silent) {
-                        print_smart_path("PWD: ", ftp_path);
-                    }
-                    
-                    draw_status_bar_real();
-                    return;
+            if (rx_link == 0 && pwd_store(rx_line)) {
+                // Si no es silencioso, imprimir
+                if (!silent) {
+                    print_smart_path("PWD: ", ftp_path);
                 }
+                return;
             }
-            rx_pos = 0;
         }
-        frames++;
     }
 }
 
-// Versión silenciosa de PWD - solo guarda el path, no imprime nada
-static void cmd_pwd_silent(void)
-{
-    pwd_core(1);
-}
-
 static void cmd_user(const char *user, const char *pass)
 {
     // Verificación de conexión
@@ -2958,6 +4084,7 @@ static void cmd_user(const char *user, const char *pass)
     }
 
     uint16_t code = 0;
+    uint8_t cwd;
     
     current_attr = ATTR_LOCAL;
     {
@@ -2968,23 +4095,24 @@ static void cmd_user(const char *user, const char *pass)
     }
     main_print(tx_buffer);
     
-    // 1. Enviar USER
-    {
-        char *p = ftp_cmd_buffer;
-        p = str_append(p, "USER ");
-        p = str_append(p, user);
-        p = str_append(p, S_CRLF);
-    }
-    if (!esp_tcp_send(0, ftp_cmd_buffer, strlen(ftp_cmd_buffer))) {
+    // 1. USER + PASS en un solo envío; las respuestas llegan en orden
+    pipe_owed = 0;
+    pipe_drop = 0;
+    ftp_batch_begin();
+    if (!ftp_batch_add("USER ", user) || !ftp_batch_add("PASS ", pass) || !ftp_batch_send()) {
         fail("Send USER failed");
         return;
     }
     
     // Respuesta USER
-    code = user_wait_ftp_response();
-    if (code == 230) goto login_success; 
+    code = pipe_reply(200);
+    if (code == 230) {
+        pipe_reply(200);  // PASS not needed: its 503/230 is dropped
+        goto login_success;
+    }
     
     if (code != 331) {
+        if (code) pipe_reply(100);  // PASS's 503/530, so it cannot answer the next command
         if (code == 530) fail(S_LOGIN_BAD); 
         else if (code > 0) {
             char *p = tx_buffer;
@@ -2995,20 +4123,8 @@ static void cmd_user(const char *user, const char *pass)
         return;
     }
     
-    // 2. Enviar PASS
-    {
-        char *p = ftp_cmd_buffer;
-        p = str_append(p, "PASS ");
-        p = str_append(p, pass);
-        p = str_append(p, S_CRLF);
-    }
-    if (!esp_tcp_send(0, ftp_cmd_buffer, strlen(ftp_cmd_buffer))) {
-        fail("Send PASS failed");
-        return;
-    }
-    
-    // Respuesta PASS
-    code = user_wait_ftp_response();
+    // 2. Respuesta PASS
+    code = pipe_reply(200);
     if (code != 230) {
         if (code == 530) fail(S_LOGIN_BAD);
         else {
@@ -3023,7 +4139,10 @@ static void cmd_user(const char *user, const char *pass)
 login_success:
     // --- ESTADO VISUAL ---
     safe_copy(ftp_user, user, sizeof(ftp_user));
+    safe_copy(ftp_pass, pass, sizeof(ftp_pass));
     connection_state = STATE_LOGGED_IN;
+    sess_host[0] = 0;
+    mir_active = 0;
     
     // PWD a "---" hasta confirmación.
     safe_copy(ftp_path, "---", sizeof(ftp_path));
@@ -3037,16 +4156,17 @@ login_success:
     current_attr = ATTR_LOCAL;
     main_print("Logged in!");
     
-    // --- CONFIGURACIÓN BINARIA ---
-    safe_copy(ftp_cmd_buffer, "TYPE I\r\n", sizeof(ftp_cmd_buffer));
-    esp_tcp_send(0, ftp_cmd_buffer, strlen(ftp_cmd_buffer));
-    
-    // Espera rápida del 200 - sale inmediatamente al detectarlo
-    wait_for_ftp_code_fast(50, "200"); // 1 segundo máximo
-
-    // Comportamiento estándar: Pedir PWD con mensaje mejorado
+    // --- CONFIGURACIÓN BINARIA + PWD en un solo envío ---
     main_puts("Getting PWD: ");  // Sin newline - continúa en misma línea
-    cmd_pwd_silent();  // Nueva versión silenciosa que solo guarda el path
+    ftp_batch_begin();
+    ftp_batch_add("TYPE I", NULL);
+    cwd = login_path && ftp_batch_add("CWD ", login_path);
+    ftp_batch_add("PWD", NULL);
+    if (ftp_batch_send()) {
+        pipe_reply(50);                                 // TYPE I: 200
+        if (cwd) pipe_reply(100);                       // CWD: PWD tells where we are
+        if (pipe_reply(200) == 257) pwd_store(rx_line);  // PWD
+    }
     
     // Imprimir path en la misma línea
     if (ftp_path[0] && strcmp(ftp_path, "---") != 0) {
@@ -3058,6 +4178,31 @@ login_success:
     }
 }
 
+// Rehace la sesión perdida: OPEN, USER/PASS y TYPE I + CWD al path guardado
+// en un solo envío. Un único intento; si falla se olvida la sesión, salvo
+// que venga de !MIRRORS OPEN: entonces se pasa al siguiente mirror.
+static uint8_t session_recover(void)
+{
+    uint8_t mir = mir_active;
+    char pass[sizeof(ftp_pass)];    // cmd_user copies its argument into ftp_pass
+    
+    current_attr = ATTR_LOCAL;
+    main_print("Session lost, reconnecting.");
+    safe_copy(pass, ftp_pass, sizeof(pass));
+    
+    cmd_open(sess_host, sess_port);
+    if (connection_state == STATE_FTP_CONNECTED) {
+        wait_frames(10);
+        if (sess_path[0] == '/') login_path = sess_path;
+        cmd_user(sess_user, pass);
+        login_path = NULL;
+    }
+    if (connection_state == STATE_LOGGED_IN) mir_active = mir;
+    else if (mir) mirror_connect(sess_user, pass, sess_host);  // Closes the failed one
+    sess_host[0] = 0;
+    return connection_state == STATE_LOGGED_IN;
+}
+
 static void cmd_pwd(void)
 {
     pwd_core(0);
@@ -3116,10 +4261,11 @@ static uint8_t decode_path_escapes(const char *in, char *out, uint8_t out_sz)
 // COMMAND: CD
 // ============================================================================
 
-static void cmd_cd(const char *path)
+// Returns 1 on 250 (ftp_path updated)
+static uint8_t cmd_cd(const char *path)
 {
-    if (!ensure_logged_in()) return;
-    uint16_t frames = 0;
+    if (!ensure_logged_in()) return 0;
+    struct deadline dl;
     
     // Allow accessing UTF-8 directory names by typing escaped bytes.
     // Example: "Gu%C3%ADas" or "Gu\xC3\xADas" (UTF-8 for "Guías")
@@ -3132,21 +4278,18 @@ static void cmd_cd(const char *path)
         p = str_append(p, "CWD ");
         p = str_append(p, path_dec);
     }
-    if (!ftp_command(tx_buffer)) return;
-    
-    rx_pos = 0;
+    if (!ftp_command(tx_buffer)) return 0;
     
     // Timeout ~5 segundos (250 frames)
-    while (frames < 250) {
-        HALT();
-        
+    deadline_start(&dl, rtt_timeout(250));
+    while (!deadline_expired(&dl)) {
         if (key_edit_down()) {
             fail(S_CANCEL);
-            return;
+            return 0;
         }
 
         if (try_read_line()) {
-            if (strncmp(rx_line, S_IPD0, 7) == 0) {
+            if (rx_link == 0) {
                 // Success: 250
                 if (strstr(rx_line, "250")) {
                     current_attr = ATTR_RESPONSE;
@@ -3181,20 +4324,19 @@ static void cmd_cd(const char *path)
                     last_path[0] = 0;
                     draw_status_bar();
                     cmd_pwd();  // Intentar obtener el path real (sobreescribe si tiene éxito)
-                    return;
+                    return 1;
                 }
                 // Error: 550 (not found), 553, etc.
                 if (strstr(rx_line, "550") || strstr(rx_line, "553") || 
                     strstr(rx_line, "501") || strstr(rx_line, "500")) {
                     fail("Directory not found");
-                    return;
+                    return 0;
                 }
             }
-            rx_pos = 0;
         }
-        frames++;
     }
     fail("CD timeout");
+    return 0;
 }
 
 // ============================================================================
@@ -3363,144 +4505,358 @@ static void ensure_unique_filename(char *dst)
 }
 
 // ============================================================================
-// CMD_GET
+// RESUME JOURNAL
 // ============================================================================
+// Una sola entrada: la última descarga interrumpida (timeout, 421, EDIT).
+// Un GET del mismo fichero remoto (servidor + directorio + nombre) con el
+// mismo nombre local continúa desde los bytes guardados aquí; GET -c
+// continúa desde el tamaño del fichero local.
 
-// Request file size via SIZE command
-// Returns file size (0 if unavailable or failed)
-static uint32_t download_request_size(const char *remote)
+static const char S_RES_FILE[] = "BITSTRM.RES";
+
+static struct res_ent {
+    uint32_t key;        // Hash of host + directory + remote (res_key)
+    uint32_t size;       // SIZE reply (0 = unknown)
+    uint32_t got;        // Bytes already in the local file
+    char     local[13];  // 8.3 local name
+} res_rec;
+
+static uint8_t g_resume = 0;  // GET -c
+
+static uint32_t res_hash(uint32_t h, const char *s)
 {
-    uint32_t file_size = 0;
-    uint16_t frames = 0;
+    while (*s) h = (h << 5) + h + (uint8_t)*s++;
+    return h;
+}
+
+// The same name on another server or in another directory is another file
+static uint32_t res_key(const char *remote)
+{
+    uint32_t h = res_hash(5381, ftp_host);
+    h = res_hash(h, "\n");
+    if (remote[0] != '/') {
+        h = res_hash(h, ftp_path);
+        h = res_hash(h, "/");
+    }
+    return res_hash(h, remote);
+}
+
+// Load the journal. Returns 1 if it belongs to remote (any local name).
+static uint8_t res_find(const char *remote)
+{
+    uint8_t h = esx_fopen_read(S_RES_FILE);
+    uint8_t ok = 0;
     
-    char *p = tx_buffer;
-    p = str_append(p, "SIZE ");
-    p = str_append(p, remote);
+    if (h == 0xFF) return 0;
+    if (esx_fread(h, &res_rec, sizeof(res_rec)) == sizeof(res_rec)) {
+        ok = (res_rec.key == res_key(remote));
+    }
+    esx_fclose(h);
+    return ok;
+}
+
+// Returns 1 if the journal belongs to this remote/local pair
+static uint8_t res_lookup(const char *remote, const char *local)
+{
+    return res_find(remote) && strcmp(res_rec.local, local) == 0;
+}
+
+// Write res_rec as the journal
+static void res_write(void)
+{
+    uint8_t h = esx_fopen_write(S_RES_FILE);
     
-    if (!ftp_command(tx_buffer)) {
-        return 0;
+    if (h == 0xFF) return;
+    esx_fwrite(h, &res_rec, sizeof(res_rec));
+    esx_fclose(h);
+}
+
+static void res_save(const char *remote, const char *local, uint32_t size, uint32_t got)
+{
+    res_rec.key = res_key(remote);
+    res_rec.size = size;
+    res_rec.got = got;
+    safe_copy(res_rec.local, local, sizeof(res_rec.local));
+    res_write();
+}
+
+// REST before RETR. Returns 1 if the server accepted the offset (350).
+static uint8_t ftp_rest(uint32_t offset)
+{
+    struct deadline dl;
+    char *p = str_append(tx_buffer, "REST ");
+    
+    u32_to_dec(p, offset);
+    if (!ftp_command(tx_buffer)) return 0;
+    
+    deadline_start(&dl, rtt_timeout(100));
+    while (!deadline_expired(&dl)) {
+        if (try_read_line() && rx_link == 0) {
+            if (strncmp(rx_line, "350", 3) == 0) return 1;
+            if (rx_line[0] == '4' || rx_line[0] == '5') return 0;
+        }
     }
+    return 0;
+}
+
+// ============================================================================
+// DOWNLOAD RETRY POLICY
+// ============================================================================
+// Los fallos de PASV, conexión de datos, RETR o datos cortados suelen ser
+// pasajeros: cmd_get repite el fichero hasta retry_max veces con espera
+// creciente. Cada intento retoma el mismo fichero local vía BITSTRM.RES.
+
+#define RETRY_LIMIT     9     // !RETRY accepts 0..RETRY_LIMIT
+#define RETRY_WAIT_MAX  8     // Backoff: 1, 2, 4, 8, 8... seconds
+
+static uint8_t retry_max = 3;   // Extra attempts per file (!RETRY)
+static uint8_t dl_fatal;        // Last failure will not go away by retrying
+static uint8_t dl_done_reply;   // 226 already seen for this transfer
+static char    dl_local[13];    // Local name used by the last attempt
+
+// Wait before the next attempt. Returns 0 if EDIT was pressed.
+static uint8_t retry_backoff(uint8_t attempt)
+{
+    struct deadline dl;
+    uint8_t secs = (attempt < 4) ? (uint8_t)(1 << (attempt - 1)) : RETRY_WAIT_MAX;
     
-    rx_pos = 0;
+    current_attr = ATTR_LOCAL;
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "Retry ");
+        p = u16_to_dec(p, attempt + 1);
+        p = char_append(p, '/');
+        p = u16_to_dec(p, retry_max + 1);
+        p = str_append(p, " in ");
+        p = u16_to_dec(p, secs);
+        p = str_append(p, " s");
+    }
+    main_print(tx_buffer);
     
-    // Timeout ~2 segundos (100 frames)
-    while (frames < 100) {
-        HALT();
-        uart_drain_to_buffer();
-        
-        if (try_read_line()) {
-            if (strncmp(rx_line, S_IPD0, 7) == 0) {
-                char *ps = strstr(rx_line, "213 ");
-                if (ps) {
-                    ps += 4;
-                    while (*ps >= '0' && *ps <= '9') {
-                        file_size = file_size * 10 + (*ps - '0');
-                        ps++;
-                    }
-                    break;
-                }
-                if (strstr(rx_line, "550") || strstr(rx_line, "ERROR")) break;
-            }
-            rx_pos = 0;
+    deadline_start(&dl, secs * FRAMES_1S);
+    while (!deadline_expired(&dl)) {
+        if (key_edit_down()) {
+            g_user_cancel = 1;
+            return 0;
         }
-        frames++;
+        uart_drain_to_buffer();
     }
+    return 1;
+}
+
+// ============================================================================
+// CMD_GET
+// ============================================================================
+
+// SIZE + PASV for remote, pipelined. If the previous file of the batch
+// already sent them (dl_next), only the replies are collected.
+// *size = 0 if SIZE is not supported. Returns 0 if PASV failed.
+static uint8_t download_prepare(const char *remote, uint32_t *size)
+{
+    char *ps;
     
-    rx_pos = 0;
-    return file_size;
+    *size = 0;
+    if (!pipe_owed || strcmp(pipe_next, remote) != 0) {
+        // Stale prefetch (batch cancelled): read its replies so ours stay in step
+        while (pipe_owed) pipe_reply(100);
+        if (!pipe_size_pasv(remote)) return 0;
+    }
+    pipe_next[0] = 0;
+    
+    // SIZE: "213 <bytes>", or 550/502 if not available
+    if (pipe_reply(100) == 213) {
+        ps = rx_line + 4;
+        while (*ps >= '0' && *ps <= '9') {
+            *size = *size * 10 + (*ps - '0');
+            ps++;
+        }
+    }
+    // PASV
+    if (pipe_reply(250) != 227) return 0;
+    return ftp_parse_227(rx_line) != 0;
 }
 
 // Wait for transfer start confirmation (150/125 response or IPD data)
 // Returns 1 on success, 0 on timeout/error
-static uint8_t download_wait_transfer_start(uint16_t *ipd_remaining, uint8_t *in_data, uint8_t *user_cancel)
+static uint8_t download_wait_transfer_start(uint8_t *user_cancel)
 {
-    uint16_t frames = 0;
-    char ctrl_buf[64];
-    uint8_t ctrl_pos = 0;
-    int16_t c;
-    
-    *in_data = 0;
-    *ipd_remaining = 0;
+    struct deadline dl;
+    uint8_t ev;
     
-    while (frames < 400) {
-        uart_drain_to_buffer();
-        c = rb_pop();
+    deadline_start(&dl, rtt_timeout(400));
+    while (!deadline_expired(&dl)) {
+        ev = dmx_poll();
         
-        if (c == -1) {
-            HALT();
+        if (ev == DMX_NONE) {
             if (key_edit_down()) {
                 *user_cancel = 1;
                 return 0;
             }
-            frames++;
             continue;
         }
         
-        if (c == '\r') continue;
+        // Data before the 150: it stays in the ring for the main loop
+        if (ev == DMX_DATA) return 1;
         
-        if (c == '\n') {
-            ctrl_buf[ctrl_pos] = 0;
+        if (ev == DMX_LINE && rx_link == 0) {
+            if (strncmp(rx_line, "550", 3) == 0 || strncmp(rx_line, "553", 3) == 0) {
+                debug_enabled = 1;
+                current_attr = ATTR_ERROR;
+                main_puts(S_ERROR_TAG);
+                main_print("File not found");
+                dl_fatal = 1;
+                return 0;
+            }
             
-            if (strncmp(ctrl_buf, S_IPD0, 7) == 0) {
-                if (strstr(ctrl_buf, "550") || strstr(ctrl_buf, "553") || 
-                    strstr(ctrl_buf, "ERROR") || strstr(ctrl_buf, "Fail")) {
-                    
-                    debug_enabled = 1;
-                    current_attr = ATTR_ERROR;
-                    main_puts(S_ERROR_TAG);
-                    main_print("File not found");
-                    return 0;
+            if (strncmp(rx_line, "150", 3) == 0 || strncmp(rx_line, "125", 3) == 0) {
+                return 1;
+            }
+        }
+    }
+    
+    return 0; // Timeout
+}
+
+// Data phase in passive mode: RETR sent, data link open. Each pull of
+// PULL_CHUNK bytes goes to SD from the ring before the next one is asked.
+// Returns 1 when the file is complete.
+// Control line seen while pulling: '2' = 226, '4'/'5' = error, 0 = other
+// (150, continuation text). Only the 3-digit code at the line start counts.
+static uint8_t pull_ctrl_code(const char *l)
+{
+    if (l[0] < '1' || l[0] > '5' || l[1] < '0' || l[1] > '9' || l[2] < '0' || l[2] > '9') return 0;
+    if (l[0] == '4' || l[0] == '5') return (uint8_t)l[0];
+    return (l[0] == '2' && l[1] == '2' && l[2] == '6') ? '2' : 0;
+}
+
+static uint8_t download_pull(uint8_t handle, const char *local_name, uint32_t file_size,
+                             uint32_t *received, uint8_t *user_cancel)
+{
+    char ctrl[64];          // Control line being assembled across pulls
+    uint8_t clen = 0;
+    uint8_t cskip = 0;      // Rest of an over-long line: already judged
+    uint8_t start;
+    uint8_t i;
+    uint8_t code;
+    uint16_t n;
+    struct deadline silence;
+    uint32_t last_progress = 0;
+    uint8_t got_226 = 0;
+    
+    pull_file = handle;
+    deadline_start(&silence, SILENCE_NORMAL);
+    while (1) {
+        if (key_edit_down()) {
+            *user_cancel = 1;
+            return 0;
+        }
+        
+        // Control replies, assembled into lines: errors and "226" end the transfer
+        if (pull_pending[0]) {
+            n = esp_tcp_recv(0, (uint8_t *)ctrl + clen, sizeof(ctrl) - 1 - clen);
+            if (n != RECV_ERROR) {
+                clen += (uint8_t)n;
+                start = 0;
+                for (i = 0; i <= clen; i++) {
+                    if (i < clen && ctrl[i] != '\n') continue;
+                    // Full line, or a line that fills the buffer (judged by its start)
+                    if (i == clen && (start || clen < sizeof(ctrl) - 1)) break;
+                    ctrl[i] = 0;
+                    code = cskip ? 0 : pull_ctrl_code(ctrl + start);
+                    cskip = (i == clen);
+                    start = i + 1;
+                    if (code == '4' || code == '5') {
+                        debug_enabled = 1;
+                        current_attr = ATTR_ERROR;
+                        main_puts(S_ERROR_TAG);
+                        main_print(code == '5' ? "File not found" : "Transfer failed");
+                        dl_fatal = (code == '5');
+                        return 0;
+                    }
+                    if (code == '2') got_226 = dl_done_reply = 1;
                 }
-                
-                if (strstr(ctrl_buf, "150") || strstr(ctrl_buf, "125")) {
-                    return 1;
+                // Keep the unfinished line for the next pull
+                if (start > clen) clen = 0;
+                else {
+                    clen -= start;
+                    memmove(ctrl, ctrl + start, clen);
                 }
             }
-            ctrl_pos = 0;
+            deadline_restart(&silence);
             continue;
         }
         
-        if (c == ':' && ctrl_pos >= 7 && strncmp(ctrl_buf, S_IPD1, 7) == 0) {
-            ctrl_buf[ctrl_pos] = 0;
-            char *p = ctrl_buf + 7;
-            *ipd_remaining = parse_decimal(&p);
-            *in_data = 1;
-            return 1;
+        // Data: pull while announced, and drain what is left after close
+        if (pull_pending[data_link] || (pull_closed & (uint8_t)(1 << data_link))) {
+            n = esp_tcp_recv(data_link, NULL, PULL_CHUNK);
+            if (n == RECV_ERROR || n == 0) {
+                if (pull_closed & (uint8_t)(1 << data_link)) break;
+                continue;
+            }
+            *received += n;
+            deadline_restart(&silence);
+            
+            if (*received - last_progress >= 1024) {
+                cts_hold();
+                draw_progress_bar(local_name, *received, file_size);
+                cts_release();
+                last_progress = *received;
+            }
+            if (file_size && *received >= file_size) return 1;
+            continue;
         }
         
-        if (ctrl_pos < sizeof(ctrl_buf) - 1) {
-            ctrl_buf[ctrl_pos++] = (char)c;
+        if (got_226 && file_size == 0) break;
+        
+        // Idle: only short notification lines arrive, so no HALT here
+        uart_drain_to_buffer();
+        if (try_read_line()) {
+            pull_note_line(rx_line);
+            deadline_restart(&silence);
+        } else if (deadline_expired(&silence)) {
+            debug_enabled = 1;
+            main_print("Timeout (No data)");
+            return 0;
         }
     }
     
-    return 0; // Timeout
+    if (file_size && *received < file_size) {
+        fail("Incomplete transfer");
+        return 0;
+    }
+    return 1;
 }
 
 static uint8_t download_file_core(const char *remote, const char *local, uint8_t b_cur, uint8_t b_tot, uint32_t *out_bytes)
 {
     uint32_t received = 0;
     uint32_t file_size = 0;
-    uint32_t timeout = 0;
-    uint32_t silence = 0;
+    struct deadline silence;
     uint8_t handle = 0xFF; 
-    uint8_t in_data = 0;
-    uint16_t ipd_remaining = 0;
     uint32_t last_progress = 0;
-    char hdr_buf[64];
-    uint8_t hdr_pos = 0;
+    uint16_t n;
+    uint16_t w;
     char local_name[32];
     uint8_t user_cancel = 0;
     uint8_t download_success = 0;
     uint8_t transfer_started = 0;
-    int16_t c; // <--- MOVIDO AQUÍ (C89 compatible)
+    uint8_t pull = 0;
+    uint8_t prealloc = 0;
+    uint8_t resume;
+    uint32_t offset = 0;  // Bytes already in the local file (REST)
+    uint8_t ev;
     
     *out_bytes = 0;
-    file_buf_pos = 0;  // Reset file buffer
+    dl_fatal = 0;
+    dl_done_reply = 0;
     sanitize_filename_83(local, local_name);
-    ensure_unique_filename(local_name);
+    resume = res_lookup(remote, local_name);
+    if (!resume && !g_resume) ensure_unique_filename(local_name);
+    safe_copy(dl_local, local_name, sizeof(dl_local));  // Retries reuse this name
     // Aseguramos modo normal y limpieza completa para la negociación
+    // (salvo si SIZE+PASV de este fichero ya están en camino)
     drain_mode_normal();
-    rx_reset_all();  // Reset completo antes de descarga
+    if (!pipe_owed) rx_reset_all();
     progress_current_file[0] = '\0';  // Reset progress tracking para forzar redraw completo
     
     current_attr = ATTR_LOCAL;
@@ -3521,21 +4877,91 @@ static uint8_t download_file_core(const char *remote, const char *local, uint8_t
     // Mostrar nombre en barra de progreso inmediatamente
     draw_progress_bar(local_name, 0, 0);
     
-    // Get file size (may return 0 if SIZE not supported)
-    file_size = download_request_size(remote);
+    // SIZE + PASV in one round trip (file_size 0 if SIZE not supported)
+    if (!download_prepare(remote, &file_size)) { fail(S_PASV_FAIL); return 0; }
+    
+    // Journal written for another version of the remote file
+    if (resume && res_rec.size != file_size) {
+        resume = 0;
+        if (!g_resume) ensure_unique_filename(local_name);
+        safe_copy(dl_local, local_name, sizeof(dl_local));
+    }
+    
+    // FILE OPEN: resume keeps what is already on disk. Before the data
+    // link, so a complete file doesn't open one.
+    if (resume || g_resume) {
+        handle = esx_fopen_rw(local_name);
+        if (handle != 0xFF) {
+            offset = resume ? res_rec.got : esx_fsize(handle);
+            // Without a journal the length is only trusted below SIZE: a
+            // full-length file may be a preallocated partial (no truncate)
+            if (!resume && file_size && offset >= file_size) offset = 0;
+            if (file_size && offset >= file_size) {
+                esx_fclose(handle);
+                if (resume) esx_unlink(S_RES_FILE);
+                current_attr = ATTR_RESPONSE;
+                main_print("Already complete");
+                *out_bytes = offset;
+                return 1;
+            }
+            if (offset && !ftp_rest(offset)) {
+                esx_fclose(handle);  // Server without REST: full download
+                handle = 0xFF;
+                offset = 0;
+            }
+        }
+    }
     
-    // PASV + DATA
-    if (ftp_passive() == 0) { fail(S_PASV_FAIL); return 0; }
-    if (!ftp_open_data()) { fail(S_DATA_FAIL); return 0; }
+    // DATA
+    if (!ftp_open_data()) {
+        if (handle != 0xFF) esx_fclose(handle);
+        fail(S_DATA_FAIL);
+        return 0;
+    }
     
-    // FILE OPEN
-    handle = esx_fopen_write(local_name);
+    if (handle == 0xFF) handle = esx_fopen_write(local_name);
     if (handle == 0xFF) {
+        dl_fatal = 1;
         fail("Cannot create local file");
         ftp_close_data();
         return 0;
     }
     
+    // Pre-allocate from SIZE: FAT chain outside the receive loop
+    if (file_size) {
+        if (!esx_prealloc(handle, file_size, offset)) {
+            esx_fclose(handle);
+            if (!offset) esx_unlink(local_name);
+            dl_fatal = 1;
+            fail("Not enough space on disk");
+            ftp_close_data();
+            return 0;
+        }
+        prealloc = 1;
+    } else if (offset) {
+        esx_fseek(handle, offset);
+    }
+    
+    if (offset) {
+        char size_buf[12];
+        format_size(offset, size_buf);
+        current_attr = ATTR_LOCAL;
+        {
+            char *p = tx_buffer;
+            p = str_append(p, "Resuming at ");
+            p = str_append(p, size_buf);
+        }
+        main_print(tx_buffer);
+        received = offset;
+        last_progress = offset;
+    }
+    
+    // Passive receive if the firmware has it (link 1 is idle until RETR)
+    if (esp_pull != PULL_NONE && (esp_caps & CAP_RECVMODE)) {
+        pull = esp_recv_mode(1);
+        esp_pull = pull ? PULL_OK : PULL_NONE;
+    }
+    
     // RETR
     {
         char *p = ftp_cmd_buffer;
@@ -3546,15 +4972,27 @@ static uint8_t download_file_core(const char *remote, const char *local, uint8_t
     
     debug_enabled = 0;
     
+    if (pull) {
+        draw_progress_bar(local_name, 0, file_size);
+        download_success = download_pull(handle, local_name, file_size, &received, &user_cancel);
+        goto get_cleanup;
+    }
+    
     // Wait for transfer start confirmation
-    if (!download_wait_transfer_start(&ipd_remaining, &in_data, &user_cancel)) {
+    if (!download_wait_transfer_start(&user_cancel)) {
         if (user_cancel) {
             goto get_cleanup;
         }
         // Transfer didn't start (error already printed or timeout)
-        if (handle != 0xFF) esx_fclose(handle);
-        esp_tcp_close(1);
-        rb_flush();
+        if (handle != 0xFF) {
+            // Still full length if truncate is missing: the journal keeps the offset
+            if (prealloc && !esx_ftruncate(handle, offset) && offset) {
+                res_save(remote, local_name, file_size, offset);
+            }
+            esx_fclose(handle);
+            if (!offset) esx_unlink(local_name);
+        }
+        ftp_close_data();
         return 0;
     }
     
@@ -3569,22 +5007,35 @@ static uint8_t download_file_core(const char *remote, const char *local, uint8_t
     // ========================================================================
     // BUCLE DE DESCARGA OPTIMIZADO + SEGURO
     // ========================================================================
-    while (timeout < TIMEOUT_LONG) {
+    // Sin tope global: mientras lleguen datos la descarga sigue
+    deadline_start(&silence, SILENCE_XLONG);
+    while (1) {
         
-        uart_drain_to_buffer();
+        ev = dmx_poll();
+        n = 0;
         
-        c = rb_pop(); // Asignación simple, variable ya declarada
+        // Payload: dmx_poll received it straight into the ring, then SD
+        // writes from ring spans. EDIT stops the receive loop (dmx_got).
+        if (ev == DMX_DATA) {
+            n = dmx_got;
+            if (n == RX_CANCEL) {
+                user_cancel = 1;
+                break;
+            }
+            w = dmx_write(handle, 0);
+            received += w;
+            n += w;                 // Activity: bytes received or written
+        }
         
         // --- NO HAY DATOS ---
-        if (c == -1) {
+        if (ev == DMX_NONE || (ev == DMX_DATA && n == 0)) {
             // SEGURIDAD EXTRA: Permitir cancelar (EDIT) incluso durante pausas
             if (key_edit_down()) {
                 user_cancel = 1;
                 break;
             }
 
-            silence++;
-            if (silence > SILENCE_XLONG) {
+            if (deadline_expired(&silence)) {
                 debug_enabled = 1;
                 main_print("Timeout (No data)");
                 break;
@@ -3593,65 +5044,57 @@ static uint8_t download_file_core(const char *remote, const char *local, uint8_t
         }
         
         // --- HAY DATOS ---
-        silence = 0;
-        timeout = 0; 
+        deadline_restart(&silence);
         
-        // Check de cancelación rápido (cada 32 bytes)
-        if (key_edit_down()) {
-            user_cancel = 1;
-            break;
-        }
-        
-        if (in_data && ipd_remaining > 0) {
-            file_buffer[file_buf_pos++] = (uint8_t)c;
-            ipd_remaining--;
-            
-            if (file_buf_pos >= 512 || ipd_remaining == 0) {
-                esx_fwrite(handle, file_buffer, file_buf_pos);
-                received += file_buf_pos;
-                file_buf_pos = 0;
-            }
-            
+        if (ev == DMX_DATA) {
             if (received - last_progress >= 1024) {
+                cts_hold();
                 draw_progress_bar(local_name, received, file_size);
+                cts_release();
                 last_progress = received;
             }
-            
-            if (ipd_remaining == 0) { in_data = 0; hdr_pos = 0; }
-        } else {
-            // MÁQUINA DE ESTADOS PARA CABECERAS
-            if (c == '\r' || c == '\n') {
-                hdr_buf[hdr_pos] = 0;
-                
-                if (strstr(hdr_buf, S_CLOSED1)) { download_success = 1; goto get_cleanup; }
-                
-                // CORREGIDO: 'hdr_buf' en lugar de 'hhdr_buf'
-                if (hdr_pos > 7 && strncmp(hdr_buf, S_IPD1, 7) == 0) {
-                    char *p = hdr_buf + 7;
-                    ipd_remaining = parse_decimal(&p);
-                    if (*p == ':') { in_data = 1; file_buf_pos = 0; }
-                }
-                hdr_pos = 0;
-            } else if (c == ':' && hdr_pos > 7 && strncmp(hdr_buf, S_IPD1, 7) == 0) {
-                hdr_buf[hdr_pos] = 0;
-                char *p = hdr_buf + 7;
-                ipd_remaining = parse_decimal(&p);
-                in_data = 1; file_buf_pos = 0; hdr_pos = 0;
-            } else if (hdr_pos < 63) {
-                hdr_buf[hdr_pos++] = (char)c;
-            }
+        } else if (ev == DMX_CLOSED && dmx_link == data_link) {
+            download_success = 1;
+            goto get_cleanup;
+        } else if (ev == DMX_LINE && rx_link == 0 && strncmp(rx_line, "226", 3) == 0) {
+            dl_done_reply = 1;  // Usually right before "n,CLOSED"
         }
+        // Other control replies (421...) arrive as lines and never touch the file
     }
 
 get_cleanup:
     drain_mode_normal();
-    if (!user_cancel && file_buf_pos > 0) {
-        esx_fwrite(handle, file_buffer, file_buf_pos);
-        received += file_buf_pos;
+    if (!user_cancel) received += dmx_write(handle, 1);  // Payload left in the ring
+    // Link closed short of SIZE: transient, the journal keeps what arrived
+    if (download_success && file_size && received < file_size) {
+        download_success = 0;
+        debug_enabled = 1;
+        fail("Incomplete transfer");
     }
+    // Lote: SIZE+PASV del siguiente mientras se cierra este fichero
+    if (download_success && !pull && dl_next) pipe_size_pasv(dl_next);
     debug_enabled = 1;
-    if (handle != 0xFF) esx_fclose(handle);
+    if (handle != 0xFF) {
+        wb_flush(handle);  // Tail of the file still in bank 1
+        if (prealloc && received < file_size) esx_ftruncate(handle, received);
+        esx_fclose(handle);
+    }
+    
+    // Resume journal: keep the point reached, drop it once complete
+    if (download_success) {
+        if (resume) esx_unlink(S_RES_FILE);
+    } else if (received) {
+        res_save(remote, local_name, file_size, received);
+    } else {
+        esx_unlink(local_name);  // Nothing written: no empty file left behind
+    }
+    if (pull) {
+        esp_recv_mode(0);  // Back to push; buffered replies follow as +IPD
+        if (download_success && dl_next) pipe_size_pasv(dl_next);
+    }
     ftp_close_data(); 
+    // If the 226 is late it must not answer the prefetched SIZE
+    if (download_success && !dl_done_reply && !ftp_wait_done()) pipe_drop = 1;
     
     if (user_cancel) {
         g_user_cancel = 1;
@@ -3812,19 +5255,17 @@ static void cmd_list_core(const char *a1, const char *a2, const char *a3)
     g_user_cancel = 0;
     drain_mode_fast(); // Velocidad máxima
     
-    uint32_t t = 0;
-    uint32_t silence = 0;
+    uint16_t t = 0;
+    struct deadline silence;
     int16_t c;
     char line_buf[128];
     uint8_t line_pos = 0;
     uint8_t matches = 0;
     uint8_t page_lines = 0;
-    uint8_t in_data = 0;
-    uint16_t ipd_remaining = 0;
-    char hdr_buf[24];
-    uint8_t hdr_pos = 0;
+    uint8_t ev;
     uint8_t header_printed = 0;
     uint8_t list_pause_risky = 0;
+    uint8_t list_closed = 0;
     
     // --- PARSEO DE ARGUMENTOS ---
     char pattern[32]; pattern[0] = 0;
@@ -3867,7 +5308,8 @@ static void cmd_list_core(const char *a1, const char *a2, const char *a3)
 
     if (!setup_list_transfer()) return;
 
-    while (t < TIMEOUT_BUSY) {
+    deadline_start(&silence, SILENCE_NORMAL);
+    while (1) {
         if ((t & 0x1FF) == 0) {
             if (key_edit_down()) {
                 fail(S_CANCEL);
@@ -3875,130 +5317,109 @@ static void cmd_list_core(const char *a1, const char *a2, const char *a3)
             }
         }
         
-        uart_drain_to_buffer();
-        c = rb_pop();
+        // Payload: dmx_poll receives the +IPD straight into the ring
+        ev = dmx_poll();
+        c = -1;
+        if (ev == DMX_DATA) {
+            if (dmx_got == RX_CANCEL) {
+                fail(S_CANCEL);
+                goto list_done;
+            }
+            c = dmx_getc();
+        }
         
-        if (c == -1) {
-            silence++;
-            if (silence > SILENCE_BUSY) break; // Timeout de silencio
+        if (ev == DMX_NONE || (ev == DMX_DATA && c == -1)) {
+            if (deadline_expired(&silence)) break; // Timeout de silencio
             t++;
             continue;
         }
-        silence = 0;
+        deadline_restart(&silence);
         t++;
         
-        if (!in_data) {
-            // Máquina de estados para cabeceras IPD
-            if (c == '\r' || c == '\n') {
-                hdr_buf[hdr_pos] = 0;
-                
-                // Check for connection closed
-                if (strstr(hdr_buf, S_CLOSED1)) goto list_done;
-                
-                // Check for IPD header (data channel)
-                if (hdr_pos > 7 && (strncmp(hdr_buf, S_IPD1, 7) == 0 || strncmp(hdr_buf, S_IPD0, 7) == 0)) {
-                    char *p = hdr_buf + 7;
-                    ipd_remaining = parse_decimal(&p);
-                    if (*p == ':') in_data = 1;
-                }
-                
-                // Check for "226 Transfer complete" - normal end
-                if (strstr(hdr_buf, "226")) goto list_done;
-                
-                hdr_pos = 0;
-            } else if (c == ':' && hdr_pos > 7 && (strncmp(hdr_buf, S_IPD1, 7) == 0 || strncmp(hdr_buf, S_IPD0, 7) == 0)) {
-                // Immediate IPD detection on ':' character
-                hdr_buf[hdr_pos] = 0;
-                char *p = hdr_buf + 7;
-                ipd_remaining = parse_decimal(&p);
-                in_data = 1;
-                hdr_pos = 0;
-            } else if (hdr_pos < 23) {
-                hdr_buf[hdr_pos++] = c;
-            } else {
-                // Buffer overflow - reset to avoid getting stuck
-                hdr_pos = 0;
+        if (ev != DMX_DATA) {
+            // Data connection closed, or "226 Transfer complete" - normal end
+            if (ev == DMX_CLOSED && dmx_link == data_link) {
+                list_closed = 1;  // 226 still to come on the control link
+                goto list_done;
             }
+            if (ev == DMX_LINE && rx_link == 0 && strncmp(rx_line, "226", 3) == 0) goto list_done;
         } else {
-            // Procesamiento de datos de lista
-            ipd_remaining--;
-            if (c == '\n') {
-                line_buf[line_pos] = 0;
-                if (line_pos > 10) {
-                    uint8_t is_dir;
-                    uint32_t size;
-                    char name[41];
-                    char type;
-                    
-                    if (list_parse_line(line_buf, line_pos, type_mode, min_size, pattern, 
-                                       &type, &is_dir, &size, name)) {
-                        
-                        if (!header_printed) {
-                            current_attr = ATTR_RESPONSE;
-                            main_print("T      Size Filename");
-                            print_char_line(22, '-');  // Como el banner
-                            header_printed = 1;
-                            page_lines = 1;  // Solo 1 línea extra (antes eran 2)
-                        }
+            // Procesamiento de datos de lista: todo el bloque del ring de una vez
+            do {
+                if (c == '\n') {
+                    line_buf[line_pos] = 0;
+                    if (line_pos > 10) {
+                        uint8_t is_dir;
+                        uint32_t size;
+                        char name[41];
+                        char type;
                         
-                        char size_str[16];
-                        format_size(size, size_str);
-                        current_attr = is_dir ? ATTR_USER : ATTR_LOCAL;
-                        
-                        {
-                            char *q = tx_buffer;
-                            uint8_t slen;
-                            q = char_append(q, type); 
-                            q = char_append(q, ' ');
-                            slen = strlen(size_str);
-                            while(slen < 9) { q=char_append(q,' '); slen++; }
-                            q = str_append(q, size_str);
-                            q = char_append(q, ' ');
-                            q = str_append(q, name);
-                        }
-                        main_print(tx_buffer);
-                        matches++;
-                        page_lines++;
-                        
-                        // PAGINACIÓN
-                        if (page_lines >= LINES_PER_PAGE) {
-                            current_attr = ATTR_RESPONSE;
-                            main_print("-- More? EDIT=stop --");
-                            drain_mode_normal();
+                        if (list_parse_line(line_buf, line_pos, type_mode, min_size, pattern, 
+                                           &type, &is_dir, &size, name)) {
+                            
+                            if (!header_printed) {
+                                current_attr = ATTR_RESPONSE;
+                                main_print("T      Size Filename");
+                                print_char_line(22, '-');  // Como el banner
+                                header_printed = 1;
+                                page_lines = 1;  // Solo 1 línea extra (antes eran 2)
+                            }
+                            
+                            char size_str[16];
+                            format_size(size, size_str);
+                            current_attr = is_dir ? ATTR_USER : ATTR_LOCAL;
+                            
                             {
-                                uint16_t idle_frames = 0;
-                                while(1) {
-                                    HALT();
-                                    uart_drain_to_buffer();
-
-                                    if (key_edit_down()) goto list_done;
-                                    if (in_inkey() != 0) break;
-
-                                    // No parsing here. Just time tracking.
-                                    if (idle_frames < 65535) idle_frames++;
-                                    if (idle_frames >= FRAMES_LIST_PAUSE_RISKY) list_pause_risky = 1;
+                                char *q = tx_buffer;
+                                uint8_t slen;
+                                q = char_append(q, type); 
+                                q = char_append(q, ' ');
+                                slen = strlen(size_str);
+                                while(slen < 9) { q=char_append(q,' '); slen++; }
+                                q = str_append(q, size_str);
+                                q = char_append(q, ' ');
+                                q = str_append(q, name);
+                            }
+                            main_print(tx_buffer);
+                            matches++;
+                            page_lines++;
+                            
+                            // PAGINACIÓN
+                            if (page_lines >= LINES_PER_PAGE) {
+                                current_attr = ATTR_RESPONSE;
+                                main_print("-- More? EDIT=stop --");
+                                drain_mode_normal();
+                                {
+                                    struct deadline pause;
+                                    deadline_start(&pause, FRAMES_LIST_PAUSE_RISKY);
+                                    while(1) {
+                                        rx_wait_frame();
+
+                                        if (key_edit_down()) goto list_done;
+                                        if (in_inkey() != 0) break;
+
+                                        // No parsing here. Just time tracking.
+                                        if (deadline_expired(&pause)) list_pause_risky = 1;
+                                    }
                                 }
+                                deadline_restart(&silence);
+                                drain_mode_fast();
+                                page_lines = 0;
                             }
-                            drain_mode_fast();
-                            page_lines = 0;
                         }
                     }
+                    line_pos = 0;
+                } else if (c >= 32 && c < 127 && line_pos < 127) {
+                    line_buf[line_pos++] = c;
                 }
-                line_pos = 0;
-            } else if (c >= 32 && c < 127 && line_pos < 127) {
-                line_buf[line_pos++] = c;
-            }
-            if (ipd_remaining == 0) in_data = 0;
+            } while ((c = dmx_getc()) != -1);
         }
     }
 
 list_done:
     drain_mode_normal();
     ftp_close_data();
-    
-    // CRITICAL: Limpiar buffers para evitar problemas en listados consecutivos
-    rx_pos = 0;
-    rx_overflow = 0;
+    if (list_closed && !ftp_wait_done()) pipe_drop = 1;
     
     current_attr = ATTR_RESPONSE;
     {
@@ -4014,26 +5435,21 @@ list_done:
     // probe the control channel cheaply before returning to the prompt.
     if (list_pause_risky && connection_state >= STATE_FTP_CONNECTED) {
         if (!quick_noop_check(FRAMES_NOOP_QUICK_TIMEOUT)) {
-            clear_ftp_state();
+            session_lost();
             fail("Disconnected (NOOP timeout)");
             draw_status_bar();
         }
     }
 }
 
-static void cmd_get(char *args)
-{
-    if (!ensure_logged_in()) return;
-    g_user_cancel = 0;
-    status_bar_overwritten = 0;
+#define MAX_BATCH 10
 
-    // Parsear argumentos en un array local
-    #define MAX_BATCH 10
-    char *argv[MAX_BATCH];
+// Parte la línea en nombres (comillas para nombres con espacios)
+static uint8_t split_args(char *p, char **argv, uint8_t max)
+{
     uint8_t argc = 0;
     
-    char *p = args;
-    while (*p && argc < MAX_BATCH) {
+    while (*p && argc < max) {
         p = skip_ws(p);
         if (!*p) break;
         
@@ -4047,22 +5463,69 @@ static void cmd_get(char *args)
             if (*p) *p++ = 0;
         }
     }
+    return argc;
+}
+
+// One file under the retry policy. Returns 1 when complete; *tries gets
+// the number of attempts made.
+static uint8_t get_with_retry(const char *remote, uint8_t b_cur, uint8_t b_tot,
+                              uint32_t *bytes, uint8_t *tries)
+{
+    const char *local = remote;
+    uint8_t ok;
+    
+    *tries = 0;
+    while (1) {
+        ok = download_file_core(remote, local, b_cur, b_tot, bytes);
+        (*tries)++;
+        if (ok || g_user_cancel || dl_fatal || *tries > retry_max) break;
+        if (connection_state != STATE_LOGGED_IN) break;  // Session gone
+        local = dl_local;  // Same local file, resumed from the journal
+        if (!retry_backoff(*tries)) break;
+    }
+    return ok;
+}
+
+static void cmd_get(char *args)
+{
+    if (!ensure_logged_in()) return;
+    g_user_cancel = 0;
+    status_bar_overwritten = 0;
+
+    // Parsear argumentos en un array local
+    char *argv[MAX_BATCH];
+    uint8_t argc = split_args(args, argv, MAX_BATCH);
+    uint8_t i;
+    
+    // GET -c: continue partial local files (REST)
+    g_resume = 0;
+    if (argc && (strcmp(argv[0], "-c") == 0 || strcmp(argv[0], "-C") == 0)) {
+        g_resume = 1;
+        for (i = 1; i < argc; i++) argv[i - 1] = argv[i];
+        argc--;
+    }
     
     if (argc == 0) {
-        main_print("GET file1 [file2 ...]");
+        main_print("GET [-c] file1 [file2 ...]");
         return;
     }
     
     // Contadores para el resumen
     uint8_t total_success = 0;
     uint32_t total_bytes = 0;
+    uint8_t tries[MAX_BATCH];  // Attempts per file, bit 7 = failed
     
-    uint8_t i;
+    memset(tries, 0, sizeof(tries));
     for (i = 0; i < argc; i++) {
         uint32_t bytes_this_file = 0;
+        uint8_t ok;
         
-        // Llamada al core
-        if (download_file_core(argv[i], argv[i], i + 1, argc, &bytes_this_file)) {
+        // Llamada al core, repetida mientras el fallo sea pasajero
+        dl_next = (i + 1 < argc) ? argv[i + 1] : NULL;
+        ok = get_with_retry(argv[i], i + 1, argc, &bytes_this_file, &tries[i]);
+        if (!ok) tries[i] |= 0x80;
+        
+        if (ok) {
             total_success++;
             total_bytes += bytes_this_file;
         } else {
@@ -4074,15 +5537,6 @@ static void cmd_get(char *args)
                 break;
             }
         }
-        
-        // Pausa de seguridad entre ficheros con drenaje activo
-        {
-            uint8_t w;
-            for (w = 0; w < 25; w++) {
-                uart_drain_to_buffer();
-                wait_frames(1);
-            }
-        }
     }
     
     // RESUMEN FINAL EN CYAN (ATTR_RESPONSE)
@@ -4098,13 +5552,423 @@ static void cmd_get(char *args)
         p = str_append(p, " files downloaded (Total ");
         p = str_append(p, bytes_buf);
         p = char_append(p, ')');
-        
-        main_print(tx_buffer);
+        
+        main_print(tx_buffer);
+    }
+    
+    // Intentos por fichero: solo los que necesitaron más de uno o fallaron
+    for (i = 0; i < argc; i++) {
+        uint8_t n = tries[i] & 0x7F;
+        if (n > 1 || (tries[i] & 0x80 && n)) {
+            char *p = tx_buffer;
+            p = str_append(p, "  ");
+            p = str_append(p, argv[i]);
+            p = str_append(p, ": ");
+            p = u16_to_dec(p, n);
+            p = str_append(p, n > 1 ? " attempts" : " attempt");
+            if (tries[i] & 0x80) p = str_append(p, ", failed");
+            main_print(tx_buffer);
+        }
+    }
+    
+    // Reset progress tracking
+    progress_current_file[0] = '\0';
+    g_resume = 0;
+    dl_next = NULL;
+    pipe_owed = 0;  // Prefetch of a file that was never reached
+    
+    // Transfers are where a marginal line speed shows up first
+    uart_check_errors();
+    
+    if (status_bar_overwritten) {
+        invalidate_status_bar();
+        draw_status_bar();
+        status_bar_overwritten = 0;
+    }
+}
+
+
+// ============================================================================
+// HELPER: DESCONEXIÓN SILENCIOSA (Para !CONNECT y QUIT)
+// ============================================================================
+static void close_connection_sequence(void)
+{
+    current_attr = ATTR_LOCAL;
+    main_print("Closing connection.");
+    
+    // 1. Envío QUIT (Protocolo FTP)
+    safe_copy(ftp_cmd_buffer, S_CMD_QUIT, sizeof(ftp_cmd_buffer));
+esp_tcp_send(0, ftp_cmd_buffer, strlen(ftp_cmd_buffer));
+    
+    // Espera breve
+    wait_drain(25);
+
+    // 2. Forzamos cierre TCP
+    uart_send_string(S_AT_CLOSE0);
+    
+    // Espera breve
+    wait_drain(10);
+    
+    // 3. LIMPIEZA TOTAL
+    rb_flush();
+    
+    clear_ftp_state();
+    
+    current_attr = ATTR_RESPONSE;
+    main_print("Disconnected");
+    draw_status_bar();
+}
+
+static void cmd_quit(void)
+{
+    // 1. Confirmación de seguridad en ROJO
+    current_attr = ATTR_ERROR;       // <--- Color Rojo Brillante
+    main_print("Disconnect (Y/N)?"); // <--- Texto cambiado
+    
+    while(1) {
+        if (ay_uart_ready()) ay_uart_read(); // Drenar basura
+        
+        uint8_t k = in_inkey();
+        
+        // N o EDIT (7) -> Cancelar
+        if (k == 'n' || k == 'N' || k == 7) { 
+            current_attr = ATTR_LOCAL;
+            main_print("Aborted");
+            return;
+        }
+        // Y o ENTER -> Confirmar y salir del bucle
+        if (k == 'y' || k == 'Y' || k == 13) {
+            break; 
+        }
+        rx_wait_frame();  // Drenar el UART mientras esperamos
+    }
+
+    // 2. Ejecutar la secuencia de cierre
+    close_connection_sequence();
+}
+
+// ============================================================================
+// TRANSFER QUEUE (BITSTRM.Q)
+// ============================================================================
+// Registros fijos en la SD: servidor, credenciales y ruta absoluta de cada
+// fichero. QUEUE RUN reconecta, hace CD y descarga en orden con la política
+// de reintentos; el estado de cada entrada se graba al terminarla, así que
+// la cola sobrevive a un reset y se continúa donde se quedó. Una entrada
+// fallida guarda su propio punto de reanudación (el diario BITSTRM.RES
+// solo tiene uno) y lo devuelve al diario antes de su siguiente intento.
+
+#define Q_PATH_SIZE 96
+#define Q_MAX       255          // Entry numbers fit uint8_t (QUEUE DEL n)
+
+#define Q_PENDING   0
+#define Q_DONE      1
+#define Q_FAILED    2
+#define Q_REMOVED   3
+
+static const char S_Q_FILE[] = "BITSTRM.Q";
+static const char S_Q_EMPTY[] = "Queue is empty";
+
+static struct {
+    uint8_t  state;
+    uint16_t port;
+    char     host[32];
+    char     user[20];
+    char     pass[20];           // Anonymous logins only; "" = ask for a login
+    char     path[Q_PATH_SIZE];  // Remote dir + '/' + file
+    struct res_ent res;          // Resume point of a failed entry (got = 0: none)
+} q_rec;
+
+// Anonymous FTP: the "password" is just an e-mail, safe to keep on SD
+static uint8_t user_is_anonymous(const char *user)
+{
+    char u[10];
+    
+    if (strlen(user) >= sizeof(u)) return 0;
+    strcpy(u, user);
+    str_to_upper(u);
+    return strcmp(u, "ANONYMOUS") == 0 || strcmp(u, "FTP") == 0;
+}
+
+// Entry idx into q_rec. Returns 0 past the end.
+static uint8_t q_load(uint8_t idx)
+{
+    uint8_t h = esx_fopen_read(S_Q_FILE);
+    uint8_t ok = 0;
+    
+    if (h == 0xFF) return 0;
+    if (esx_fseek(h, (uint32_t)idx * sizeof(q_rec))) {
+        ok = (esx_fread(h, &q_rec, sizeof(q_rec)) == sizeof(q_rec));
+    }
+    esx_fclose(h);
+    return ok;
+}
+
+// Rewrite the state byte of entry idx (closed at once: survives a reset)
+static void q_set_state(uint8_t idx, uint8_t state)
+{
+    uint8_t h = esx_fopen_rw(S_Q_FILE);
+    
+    if (h == 0xFF) return;
+    if (esx_fseek(h, (uint32_t)idx * sizeof(q_rec))) esx_fwrite(h, &state, 1);
+    esx_fclose(h);
+}
+
+// Rewrite the whole entry idx from q_rec
+static void q_save(uint8_t idx)
+{
+    uint8_t h = esx_fopen_rw(S_Q_FILE);
+    
+    if (h == 0xFF) return;
+    if (esx_fseek(h, (uint32_t)idx * sizeof(q_rec))) esx_fwrite(h, &q_rec, sizeof(q_rec));
+    esx_fclose(h);
+}
+
+static void queue_add(char *args)
+{
+    char *argv[MAX_BATCH];
+    uint8_t argc = split_args(args, argv, MAX_BATCH);
+    uint8_t i, h;
+    uint16_t n;
+    char *p;
+    
+    if (!ensure_logged_in()) return;
+    if (argc == 0) {
+        fail("Usage: QUEUE ADD file [...]");
+        return;
+    }
+    if (ftp_path[0] != '/') {
+        fail("Unknown remote dir, use PWD");
+        return;
+    }
+    
+    h = esx_fopen_rw(S_Q_FILE);
+    if (h != 0xFF) esx_fseek(h, esx_fsize(h));
+    else h = esx_fopen_write(S_Q_FILE);
+    if (h == 0xFF) {
+        fail("Cannot write BITSTRM.Q");
+        return;
+    }
+    n = (uint16_t)(esx_fsize(h) / sizeof(q_rec));
+    
+    for (i = 0; i < argc; i++) {
+        if (n >= Q_MAX) {
+            fail("Queue full");
+            break;
+        }
+        memset(&q_rec, 0, sizeof(q_rec));
+        q_rec.state = Q_PENDING;
+        q_rec.port = ftp_port;
+        safe_copy(q_rec.host, ftp_host, sizeof(q_rec.host));
+        safe_copy(q_rec.user, ftp_user, sizeof(q_rec.user));
+        if (user_is_anonymous(ftp_user)) safe_copy(q_rec.pass, ftp_pass, sizeof(q_rec.pass));
+        
+        if (argv[i][0] == '/') {
+            p = q_rec.path;
+        } else {
+            p = str_append(q_rec.path, ftp_path);
+            if (p[-1] != '/') p = char_append(p, '/');
+        }
+        if ((p - q_rec.path) + strlen(argv[i]) >= Q_PATH_SIZE) {
+            fail("Path too long");
+            continue;
+        }
+        str_append(p, argv[i]);
+        
+        if (esx_fwrite(h, &q_rec, sizeof(q_rec)) != sizeof(q_rec)) {
+            fail("Disk full");
+            break;
+        }
+        n++;
+        current_attr = ATTR_LOCAL;
+        {
+            char *t = tx_buffer;
+            t = str_append(t, "Queued: ");
+            t = str_append(t, q_rec.path);
+        }
+        main_print(tx_buffer);
+    }
+    esx_fclose(h);
+}
+
+static void queue_list(void)
+{
+    uint8_t idx;
+    uint8_t shown = 0;
+    char host[32];
+    
+    host[0] = 0;
+    for (idx = 0; q_load(idx); idx++) {
+        if (q_rec.state == Q_REMOVED) continue;
+        
+        // Server line only when it changes
+        if (strcmp(host, q_rec.host) != 0) {
+            safe_copy(host, q_rec.host, sizeof(host));
+            current_attr = ATTR_RESPONSE;
+            main_print(host);
+        }
+        current_attr = (q_rec.state == Q_FAILED) ? ATTR_ERROR : ATTR_LOCAL;
+        {
+            char *p = tx_buffer;
+            p = u16_to_dec(p, idx + 1);
+            p = char_append(p, ' ');
+            p = char_append(p, q_rec.state == Q_DONE ? '*' : (q_rec.state == Q_FAILED ? '!' : ' '));
+            p = char_append(p, ' ');
+            p = str_append(p, q_rec.path);
+        }
+        main_print(tx_buffer);
+        shown++;
+    }
+    current_attr = ATTR_LOCAL;
+    if (!shown) main_print(S_Q_EMPTY);
+}
+
+static void queue_remove(char *arg)
+{
+    char *q = arg;
+    uint16_t n;
+    
+    str_to_upper(arg);
+    if (strcmp(arg, "ALL") == 0) {
+        esx_unlink(S_Q_FILE);
+        current_attr = ATTR_LOCAL;
+        main_print("Queue cleared");
+        return;
+    }
+    
+    n = parse_decimal(&q);
+    if (n == 0 || n > 255 || !q_load((uint8_t)(n - 1)) || q_rec.state == Q_REMOVED) {
+        fail("Usage: QUEUE DEL n|ALL");
+        return;
+    }
+    q_set_state((uint8_t)(n - 1), Q_REMOVED);
+    current_attr = ATTR_LOCAL;
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "Removed: ");
+        p = str_append(p, q_rec.path);
+    }
+    main_print(tx_buffer);
+}
+
+// Logged in to the server of q_rec, reconnecting if needed
+static uint8_t queue_session(void)
+{
+    if (connection_state == STATE_LOGGED_IN && ftp_port == q_rec.port &&
+        strcmp(ftp_host, q_rec.host) == 0 && strcmp(ftp_user, q_rec.user) == 0) {
+        return 1;
+    }
+    // Real passwords are not kept in BITSTRM.Q: the user logs in first
+    if (!q_rec.pass[0]) {
+        char *p = tx_buffer;
+        p = str_append(p, "Log in to ");
+        p = str_append(p, q_rec.host);
+        p = str_append(p, " as ");
+        p = str_append(p, q_rec.user);
+        p = str_append(p, " first");
+        fail(tx_buffer);
+        return 0;
+    }
+    if (connection_state >= STATE_FTP_CONNECTED) close_connection_sequence();
+    
+    cmd_open(q_rec.host, q_rec.port);
+    if (connection_state != STATE_FTP_CONNECTED) return 0;
+    wait_frames(10);
+    cmd_user(q_rec.user, q_rec.pass);
+    return connection_state == STATE_LOGGED_IN;
+}
+
+static void queue_run(void)
+{
+    uint8_t idx;
+    uint8_t todo = 0;
+    uint8_t cur = 0;
+    uint8_t n_ok = 0;
+    uint8_t n_fail = 0;
+    uint8_t tries;
+    uint32_t bytes;
+    uint32_t total = 0;
+    char *slash;
+    
+    for (idx = 0; q_load(idx); idx++) {
+        if (q_rec.state == Q_PENDING || q_rec.state == Q_FAILED) todo++;
+    }
+    if (!todo) {
+        current_attr = ATTR_LOCAL;
+        main_print(S_Q_EMPTY);
+        return;
+    }
+    
+    g_user_cancel = 0;
+    status_bar_overwritten = 0;
+    for (idx = 0; q_load(idx); idx++) {
+        if (q_rec.state != Q_PENDING && q_rec.state != Q_FAILED) continue;
+        cur++;
+        
+        if (!queue_session()) {
+            fail("Queue stopped: cannot log in");
+            break;
+        }
+        
+        // dir + file: CD only when the session is elsewhere
+        slash = strrchr(q_rec.path, '/');
+        if (!slash) {
+            q_set_state(idx, Q_FAILED);
+            n_fail++;
+            continue;
+        }
+        *slash = 0;
+        if (strcmp(ftp_path, slash == q_rec.path ? "/" : q_rec.path) != 0 &&
+            !cmd_cd(slash == q_rec.path ? "/" : q_rec.path)) {
+            q_set_state(idx, Q_FAILED);
+            n_fail++;
+            continue;
+        }
+        *slash = '/';
+        
+        // Its own resume point back into the journal (key made after the CD)
+        if (q_rec.res.got) {
+            memcpy(&res_rec, &q_rec.res, sizeof(res_rec));
+            res_write();
+        }
+        
+        bytes = 0;
+        if (get_with_retry(slash + 1, cur, todo, &bytes, &tries)) {
+            q_set_state(idx, Q_DONE);
+            n_ok++;
+            total += bytes;
+        } else {
+            // The next entry's failure would overwrite the journal
+            if (res_find(slash + 1)) memcpy(&q_rec.res, &res_rec, sizeof(res_rec));
+            else q_rec.res.got = 0;
+            q_rec.state = Q_FAILED;
+            q_save(idx);
+            n_fail++;
+        }
+        if (g_user_cancel) {
+            main_print("Queue paused by user");
+            break;
+        }
+    }
+    
+    current_attr = ATTR_RESPONSE;
+    {
+        char size_buf[16];
+        char *p = tx_buffer;
+        format_size(total, size_buf);
+        p = str_append(p, "Queue: ");
+        p = u16_to_dec(p, n_ok);
+        p = str_append(p, " done, ");
+        p = u16_to_dec(p, n_fail);
+        p = str_append(p, " failed (");
+        p = str_append(p, size_buf);
+        p = char_append(p, ')');
     }
+    main_print(tx_buffer);
     
-    // Reset progress tracking
-    progress_current_file[0] = '\0';
+    // Todo descargado: la cola ya no hace falta
+    if (n_ok == todo) esx_unlink(S_Q_FILE);
     
+    progress_current_file[0] = '\0';
     if (status_bar_overwritten) {
         invalidate_status_bar();
         draw_status_bar();
@@ -4112,67 +5976,291 @@ static void cmd_get(char *args)
     }
 }
 
+// QUEUE [LIST] | QUEUE ADD file [...] | QUEUE DEL n|ALL | QUEUE RUN
+static void cmd_queue(char *args)
+{
+    char *sub = args;
+    char *rest;
+    
+    while (*args && *args != ' ') args++;
+    rest = args;
+    if (*rest) *rest++ = 0;
+    rest = skip_ws(rest);
+    str_to_upper(sub);
+    
+    if (!sub[0] || strcmp(sub, "LIST") == 0) queue_list();
+    else if (strcmp(sub, "ADD") == 0) queue_add(rest);
+    else if (strcmp(sub, "DEL") == 0) queue_remove(rest);
+    else if (strcmp(sub, "RUN") == 0) queue_run();
+    else fail("Usage: QUEUE [LIST|ADD|DEL|RUN]");
+}
 
 // ============================================================================
-// HELPER: DESCONEXIÓN SILENCIOSA (Para !CONNECT y QUIT)
+// MIRRORS (BITSTRM.MIR)
 // ============================================================================
-static void close_connection_sequence(void)
+// Lista de servidores equivalentes de un mismo sitio (host[:puerto][/path]).
+// !MIRRORS OPEN mide en cada uno conexión TCP + banner 220, guarda la lista
+// ordenada por ese tiempo y entra en el más rápido; si un mirror no deja
+// entrar, o se cae la sesión después, se pasa al siguiente de la lista.
+
+#define MIR_MAX     4
+#define MIR_UNKNOWN 0         // Not measured yet
+#define MIR_DOWN    0xFFFF    // Did not answer the last probe
+
+struct mir_ent {
+    uint16_t lat;             // Connect + banner, frames
+    uint16_t port;
+    char     host[32];
+    char     path[PATH_SIZE]; // Absolute, "" = login dir
+};
+
+static const char S_MIR_FILE[] = "BITSTRM.MIR";
+static struct mir_ent mir_tab[MIR_MAX];
+static uint8_t mir_n;
+
+static void mir_load(void)
 {
-    uint16_t t;
+    uint8_t h = esx_fopen_read(S_MIR_FILE);
+    
+    memset(mir_tab, 0, sizeof(mir_tab));
+    mir_n = 0;
+    if (h == 0xFF) return;
+    if (esx_fread(h, mir_tab, sizeof(mir_tab)) == sizeof(mir_tab)) {
+        while (mir_n < MIR_MAX && mir_tab[mir_n].host[0]) mir_n++;
+    }
+    esx_fclose(h);
+}
+
+static uint8_t mir_save(void)
+{
+    uint8_t h = esx_fopen_write(S_MIR_FILE);
+    uint8_t ok;
+    
+    if (h == 0xFF) return 0;
+    ok = (esx_fwrite(h, mir_tab, sizeof(mir_tab)) == sizeof(mir_tab));
+    esx_fclose(h);
+    return ok;
+}
+
+static void mirror_print(uint8_t i)
+{
+    struct mir_ent *m = &mir_tab[i];
+    char *p = tx_buffer;
+    
+    current_attr = (m->lat == MIR_DOWN) ? ATTR_ERROR : ATTR_LOCAL;
+    p = u16_to_dec(p, i + 1);
+    p = char_append(p, ' ');
+    p = str_append(p, m->host);
+    if (m->port != 21) {
+        p = char_append(p, ':');
+        p = u16_to_dec(p, m->port);
+    }
+    p = str_append(p, m->path);
+    if (m->lat == MIR_DOWN) {
+        p = str_append(p, " down");
+    } else if (m->lat != MIR_UNKNOWN) {
+        p = char_append(p, ' ');
+        p = u16_to_dec(p, m->lat * 20);
+        p = str_append(p, " ms");
+    }
+    main_print(tx_buffer);
+}
+
+static void mirror_list(void)
+{
+    uint8_t i;
     
+    for (i = 0; i < mir_n; i++) mirror_print(i);
     current_attr = ATTR_LOCAL;
-    main_print("Closing connection.");
+    if (!mir_n) main_print("No mirrors");
+}
+
+static void mirror_add(char *spec)
+{
+    struct mir_ent *m = &mir_tab[mir_n];
+    char *host;
+    char *path;
     
-    // 1. Envío QUIT (Protocolo FTP)
-    safe_copy(ftp_cmd_buffer, S_CMD_QUIT, sizeof(ftp_cmd_buffer));
-esp_tcp_send(0, ftp_cmd_buffer, strlen(ftp_cmd_buffer));
+    if (!spec[0]) {
+        fail("Usage: !MIRRORS ADD host[:port][/path]");
+        return;
+    }
+    if (mir_n == MIR_MAX) {
+        fail("Mirror list full");
+        return;
+    }
     
-    // Espera breve
-    for (t = 0; t < 25; t++) { uart_drain_to_buffer(); wait_frames(1); }
+    m->port = parse_host_port_path(spec, &host, &path);
+    if (!host[0] || strlen(host) >= sizeof(m->host) ||
+        (path && strlen(path) >= sizeof(m->path) - 1)) {
+        fail("Host or path too long");
+        return;
+    }
+    safe_copy(m->host, host, sizeof(m->host));
+    m->path[0] = 0;
+    if (path && path[0]) {
+        m->path[0] = '/';
+        safe_copy(m->path + 1, path, sizeof(m->path) - 1);
+    }
+    m->lat = MIR_UNKNOWN;
+    
+    if (!mir_save()) {
+        fail("Cannot write BITSTRM.MIR");
+        return;
+    }
+    mir_n++;
+    mirror_print(mir_n - 1);
+}
 
-    // 2. Forzamos cierre TCP
-    uart_send_string(S_AT_CLOSE0);
+static void mirror_remove(char *arg)
+{
+    char *q = arg;
+    uint16_t n;
     
-    // Espera breve
-    for (t = 0; t < 10; t++) { uart_drain_to_buffer(); wait_frames(1); }
+    str_to_upper(arg);
+    if (strcmp(arg, "ALL") == 0) {
+        esx_unlink(S_MIR_FILE);
+        mir_n = 0;
+        current_attr = ATTR_LOCAL;
+        main_print("Mirrors cleared");
+        return;
+    }
     
-    // 3. LIMPIEZA TOTAL
-    rb_flush();
-    rx_pos = 0;
+    n = parse_decimal(&q);
+    if (n == 0 || n > mir_n) {
+        fail("Usage: !MIRRORS DEL n|ALL");
+        return;
+    }
+    mir_n--;
+    memmove(&mir_tab[n - 1], &mir_tab[n], (mir_n - (n - 1)) * sizeof(struct mir_ent));
+    memset(&mir_tab[mir_n], 0, sizeof(struct mir_ent));
+    mir_save();
+    mirror_list();
+}
+
+// Connect + banner time to mirror i, in frames (MIR_DOWN if no 220)
+static uint16_t mirror_probe(uint8_t i)
+{
+    struct mir_ent *m = &mir_tab[i];
+    uint16_t t0 = frames_now();
+    uint8_t r = BANNER_TIMEOUT;
     
-    clear_ftp_state();
+    debug_enabled = 0;
+    if (dns_connect(m->host, m->port)) {
+        r = ftp_wait_banner();
+        if (r == BANNER_OK) {
+            t0 = frames_now() - t0;
+            esp_tcp_send(0, S_CMD_QUIT, 6);
+        }
+    }
+    debug_enabled = 1;
+    esp_tcp_close(0);
+    rx_reset_all();
     
-    current_attr = ATTR_RESPONSE;
-    main_print("Disconnected");
-    draw_status_bar();
+    if (r == BANNER_CANCEL || key_edit_down()) g_user_cancel = 1;
+    if (r != BANNER_OK) return MIR_DOWN;
+    return t0 ? t0 : 1;
 }
 
-static void cmd_quit(void)
+// Log in to the first mirror (in rank order) that lets us in, skipping
+// the host 'skip'. The session starts in the mirror's path. A connection
+// left open by a failed login is closed first, or cmd_open would ask.
+static uint8_t mirror_connect(const char *user, const char *pass, const char *skip)
 {
-    // 1. Confirmación de seguridad en ROJO
-    current_attr = ATTR_ERROR;       // <--- Color Rojo Brillante
-    main_print("Disconnect (Y/N)?"); // <--- Texto cambiado
+    struct mir_ent *m;
+    uint8_t i;
     
-    while(1) {
-        if (ay_uart_ready()) ay_uart_read(); // Drenar basura
-        
-        uint8_t k = in_inkey();
+    if (connection_state >= STATE_FTP_CONNECTED) close_connection_sequence();
+    mir_load();
+    for (i = 0, m = mir_tab; i < mir_n; i++, m++) {
+        if (skip && strcmp(m->host, skip) == 0) continue;
+        if (key_edit_down()) break;
         
-        // N o EDIT (7) -> Cancelar
-        if (k == 'n' || k == 'N' || k == 7) { 
-            current_attr = ATTR_LOCAL;
-            main_print("Aborted");
-            return;
+        cmd_open(m->host, m->port);
+        if (connection_state != STATE_FTP_CONNECTED) continue;
+        wait_frames(10);
+        if (m->path[0]) login_path = m->path;
+        cmd_user(user, pass);
+        login_path = NULL;
+        if (connection_state == STATE_LOGGED_IN) {
+            mir_active = 1;
+            return 1;
         }
-        // Y o ENTER -> Confirmar y salir del bucle
-        if (k == 'y' || k == 'Y' || k == 13) {
-            break; 
+        close_connection_sequence();
+    }
+    return 0;
+}
+
+static void mirror_open(char *args)
+{
+    char *argv[2];
+    uint8_t argc = split_args(args, argv, 2);
+    uint8_t i, j, k;
+    uint8_t *a;
+    
+    if (argc == 0) {
+        fail("Usage: !MIRRORS OPEN user [pwd]");
+        return;
+    }
+    if (!mir_n) {
+        fail("No mirrors. Use !MIRRORS ADD");
+        return;
+    }
+    if (!confirm_disconnect()) return;
+    
+    // Medir todos y ordenar (burbuja, estable: a igualdad manda la lista)
+    g_user_cancel = 0;
+    for (i = 0; i < mir_n && !g_user_cancel; i++) {
+        current_attr = ATTR_LOCAL;
+        {
+            char *p = tx_buffer;
+            p = str_append(p, "Probing ");
+            p = str_append(p, mir_tab[i].host);
+            p = str_append(p, S_DOTS);
+        }
+        main_print(tx_buffer);
+        mir_tab[i].lat = mirror_probe(i);
+    }
+    if (g_user_cancel) {
+        fail(S_CANCEL);
+        return;
+    }
+    for (i = mir_n; i > 1; i--) {
+        for (j = 0; j < i - 1; j++) {
+            if (mir_tab[j].lat <= mir_tab[j + 1].lat) continue;
+            a = (uint8_t *)&mir_tab[j];     // Swap in place: no 84-byte temp on the stack
+            for (k = 0; k < sizeof(struct mir_ent); k++) {
+                uint8_t t = a[k];
+                a[k] = a[k + sizeof(struct mir_ent)];
+                a[k + sizeof(struct mir_ent)] = t;
+            }
         }
-        HALT();  // Procesar interrupciones mientras esperamos
     }
+    mir_save();
+    mirror_list();
+    
+    if (!mirror_connect(argv[0], argc > 1 ? argv[1] : "zx@zx.net", NULL)) {
+        fail("No mirror available");
+    }
+}
 
-    // 2. Ejecutar la secuencia de cierre
-    close_connection_sequence();
+static void cmd_mirrors(char *args)
+{
+    char *sub = args;
+    char *rest;
+    
+    while (*args && *args != ' ') args++;
+    rest = args;
+    if (*rest) *rest++ = 0;
+    rest = skip_ws(rest);
+    str_to_upper(sub);
+    
+    mir_load();
+    if (!sub[0] || strcmp(sub, "LIST") == 0) mirror_list();
+    else if (strcmp(sub, "ADD") == 0) mirror_add(rest);
+    else if (strcmp(sub, "DEL") == 0) mirror_remove(rest);
+    else if (strcmp(sub, "OPEN") == 0) mirror_open(rest);
+    else fail("Usage: !MIRRORS [LIST|ADD|DEL|OPEN]");
 }
 
 // ============================================================================
@@ -4272,15 +6360,14 @@ static void cmd_status(void)
         
         // Enviar NOOP para verificar que el servidor responde
         if (ftp_command("NOOP")) {
-            uint16_t frames = 0;
+            struct deadline dl;
             uint8_t got_response = 0;
             uint8_t cancelled = 0;
             uint8_t got_disconnect = 0;
             
-            // Timeout reducido: ~3 segundos = 150 frames
-            while (frames < 150) {
-                HALT();
-                
+            // Timeout reducido: ~3 segundos = 150 frames como máximo
+            deadline_start(&dl, rtt_timeout(150));
+            while (!deadline_expired(&dl)) {
                 // Cancelación con EDIT
                 if (key_edit_down()) {
                     cancelled = 1;
@@ -4288,28 +6375,18 @@ static void cmd_status(void)
                 }
                 
                 if (try_read_line()) {
-                    // Respuesta numérica (200, etc)
-                    if (rx_line[0] >= '1' && rx_line[0] <= '5') {
+                    // Respuesta numérica (200, etc) por el canal de control
+                    if (rx_link == 0 && rx_line[0] >= '1' && rx_line[0] <= '5') {
                         got_response = 1;
                         break;
                     }
-                    // Respuesta dentro de +IPD
-                    if (strncmp(rx_line, S_IPD0, 7) == 0) {
-                        char *ptr = strchr(rx_line, ':');
-                        if (ptr && ptr[1] >= '1' && ptr[1] <= '5') {
-                            got_response = 1;
-                            break;
-                        }
-                    }
                     // Detectar desconexión
                     if (check_disconnect_message()) {
-                        clear_ftp_state();
+                        session_lost();
                         got_disconnect = 1;
                         break;
                     }
-                    rx_pos = 0;
                 }
-                frames++;
             }
             
             if (cancelled) {
@@ -4379,11 +6456,112 @@ static void cmd_status(void)
         main_print(tx_buffer);
     }
     
-    // E. DEBUG
+    // E. RTT
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "RTT:   ");
+        if (rtt_valid) {
+            p = u16_to_dec(p, (rtt_srtt8 >> 1) * 5);      // x20/8
+            p = str_append(p, " ms +/- ");
+            p = u16_to_dec(p, rtt_var4 * 5);
+            p = str_append(p, " ms");
+        } else {
+            p = str_append(p, "not measured");
+        }
+        main_print(tx_buffer);
+    }
+    
+    // F. UART
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "UART:  ");
+        p = u16_to_dec(p, baud_rate[uart_speed]);
+        p = str_append(p, " bps");
+        if (uart_flow) p = str_append(p, ", CTS");
+        p = str_append(p, ", ");
+        p = u16_to_dec(p, wr_forced);
+        p = str_append(p, " forced writes");
+        main_print(tx_buffer);
+    }
+    
+    // G. ESP capabilities
+    {
+        char *p = tx_buffer;
+        uint8_t i;
+        p = str_append(p, "ESP:  ");
+        for (i = 0; i < CAP_COUNT; i++) {
+            if (esp_caps & (1 << i)) {
+                p = char_append(p, ' ');
+                p = str_append(p, cap_names[i]);
+            }
+        }
+        if (!esp_caps) p = str_append(p, " basic AT");
+        main_print(tx_buffer);
+    }
+    
+    // H. DEBUG
     if (debug_mode) main_print("Debug: ON");
     else main_print("Debug: OFF");
 }
 
+// !BAUD [rate] - show or switch the UART speed profile
+static void cmd_baud(const char *arg)
+{
+    uint8_t i;
+    
+    if (arg[0]) {
+        char *q = (char*)arg;
+        uint16_t rate = parse_decimal(&q);
+        for (i = 0; i < BAUD_PROFILES; i++) {
+            if (baud_rate[i] == rate) break;
+        }
+        if (i == BAUD_PROFILES) {
+            fail("Usage: !BAUD [9600|19200]");
+            return;
+        }
+        if (i != uart_speed && !(esp_caps & CAP_UART_CUR)) {
+            fail("Firmware has no AT+UART_CUR");
+            return;
+        }
+        current_attr = ATTR_LOCAL;
+        main_print("Switching speed.");
+        if (!uart_set_speed(i)) fail("No reply, speed unchanged");
+    }
+    
+    current_attr = ATTR_RESPONSE;
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "UART: ");
+        p = u16_to_dec(p, baud_rate[uart_speed]);
+        p = str_append(p, " bps, ");
+        p = u16_to_dec(p, ay_uart_ferr);
+        p = str_append(p, " framing errors");
+    }
+    main_print(tx_buffer);
+}
+
+static void cmd_retry(const char *arg)
+{
+    if (arg[0]) {
+        char *q = (char*)arg;
+        uint16_t n = parse_decimal(&q);
+        if (arg[0] < '0' || arg[0] > '9' || n > RETRY_LIMIT) {
+            fail("Usage: !RETRY [0-9]");
+            return;
+        }
+        retry_max = (uint8_t)n;
+    }
+    
+    current_attr = ATTR_RESPONSE;
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "GET retries: ");
+        p = u16_to_dec(p, retry_max);
+        p = str_append(p, " per file, backoff 1-8 s");
+    }
+    main_print(tx_buffer);
+}
+
 static void cmd_help(void)
 {
     current_attr = ATTR_RESPONSE;  // Azul
@@ -4396,7 +6574,8 @@ static void cmd_help(void)
     main_print("  PWD  - Show dir");
     main_print("  CD path - Change dir");
     main_print("  LS [filter] - List (-d/-f)");
-    main_print("  GET file - Download");
+    main_print("  GET [-c] file - Download");
+    main_print("  QUEUE [ADD|DEL|RUN] - SD queue");
     main_print("Type !HELP for more commands");
 }
 
@@ -4412,6 +6591,10 @@ static void cmd_help_special(void)
     main_print("  !STATUS - WiFi & FTP info");
     main_print("  !CLS - Clear screen");
     main_print("  !DEBUG - Toggle debug");
+    main_print("  !BAUD [rate] - UART speed");
+    main_print("  !RETRY [n] - GET retries");
+    main_print("  !KEEPALIVE [s] - Idle NOOP");
+    main_print("  !MIRRORS [ADD|DEL|OPEN] - Mirrors");
     main_print("  !INIT - Reset ESP");
     main_print("  !ABOUT - Version");
     current_attr = ATTR_RESPONSE;
@@ -4504,8 +6687,7 @@ static void parse_command(char *line)
                         p = str_append(p, init_path);
                     }
                     main_print(tx_buffer);
-                    uint8_t w;
-                    for(w=0; w<25; w++) { uart_drain_to_buffer(); wait_frames(1); }
+                    wait_drain(25);
                     cmd_cd(init_path);
                 }
                 else if (connection_state == STATE_LOGGED_IN) {
@@ -4520,6 +6702,15 @@ static void parse_command(char *line)
     
     if (strcmp(cmd, "!SEARCH") == 0) { cmd_list_core(arg1, arg2, arg3); return; }
     if (strcmp(cmd, "!STATUS") == 0) { cmd_status(); return; }
+    if (strcmp(cmd, "!BAUD") == 0)   { cmd_baud(arg1); return; }
+    if (strcmp(cmd, "!RETRY") == 0)  { cmd_retry(arg1); return; }
+    if (strcmp(cmd, "!KEEPALIVE") == 0) { cmd_keepalive(arg1); return; }
+    if (strcmp(cmd, "!MIRRORS") == 0) {
+        char *args_ptr = line;
+        while (*args_ptr && *args_ptr != ' ') args_ptr++;
+        cmd_mirrors(skip_ws(args_ptr));
+        return;
+    }
     if (strcmp(cmd, "!ABOUT") == 0)  { cmd_about(); return; }
     if (strcmp(cmd, "!CLS") == 0)    { cmd_cls(); return; }
     if (strcmp(cmd, "!DEBUG") == 0) {
@@ -4580,9 +6771,14 @@ static void parse_command(char *line)
         if (*args_ptr) {
             cmd_get(args_ptr);
         } else {
-            fail("Usage: GET file1 [file2 ...]");
+            fail("Usage: GET [-c] file1 [file2 ...]");
         }
     }
+    else if (strcmp(cmd, "QUEUE") == 0) {
+        char *args_ptr = line;
+        while (*args_ptr && *args_ptr != ' ') args_ptr++;
+        cmd_queue(skip_ws(args_ptr));
+    }
     else if (strcmp(cmd, "QUIT") == 0) {
         cmd_quit();
     }
@@ -4642,6 +6838,43 @@ static void init_screen(void)
 // BACKGROUND MONITORING
 // ============================================================================
 
+// Aviso de desconexión en reposo: limpia estado, cierra el socket y
+// repinta la línea de entrada
+static void report_disconnect(const char *reason)
+{
+    current_attr = ATTR_ERROR;
+    main_newline();
+    
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "Disconnected: ");
+        p = str_append(p, reason);
+    }
+    main_print(tx_buffer);
+    
+    // Limpiar estado (recordando la sesión para session_recover)
+    session_lost();
+    
+    // Asegurar cierre físico
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "AT+CIPCLOSE=0\r\n");
+        uart_send_string(tx_buffer);
+    }
+    
+    draw_status_bar();
+    main_newline();
+    redraw_input_from(0);
+}
+
+static const char *disconnect_reason(uint8_t disc)
+{
+    if (disc == 1) return "Remote host closed socket";
+    // disc == 2: 421 message
+    if (str_contains(rx_line, "imeout")) return "Idle Timeout (421)";
+    return "Service Closing (421)";
+}
+
 static void check_connection_alive(void)
 {
     // Solo detectamos desconexiones si hay una conexión TCP activa
@@ -4660,47 +6893,83 @@ static void check_connection_alive(void)
     if (try_read_line()) {
         uint8_t disc = check_disconnect_message();
         
-        if (disc) {
-            const char *reason;
-            if (disc == 1) {
-                reason = "Remote host closed socket";
-            } else {
-                // disc == 2: 421 message
-                if (str_contains(rx_line, "imeout")) reason = "Idle Timeout (421)";
-                else reason = "Service Closing (421)";
-            }
-            
-            current_attr = ATTR_ERROR;
-            main_newline();
-            
-            {
-                char *p = tx_buffer;
-                p = str_append(p, "Disconnected: ");
-                p = str_append(p, reason);
-            }
-            main_print(tx_buffer);
-            
-            // Limpiar estado
-            clear_ftp_state();
-            
-            // Asegurar cierre físico
-            {
-                char *p = tx_buffer;
-                p = str_append(p, "AT+CIPCLOSE=0\r\n");
-                uart_send_string(tx_buffer);
-            }
-            
-            draw_status_bar();
-            main_newline();
-            redraw_input_from(0);
-        }
-        rx_pos = 0;
+        if (disc) report_disconnect(disconnect_reason(disc));
     }
     
     // Restauramos el límite
     uart_drain_limit = prev_limit;
 }
 
+// ============================================================================
+// IDLE KEEPALIVE
+// ============================================================================
+// Los servidores cortan la sesión tras 300-900 s sin comandos. Si el usuario
+// no teclea en keepalive_secs, el bucle principal manda un NOOP (nunca
+// durante un comando: parse_command no vuelve al bucle hasta terminar).
+// Un NOOP sin respuesta se repite a los KEEPALIVE_RETRY s; el segundo fallo
+// seguido se trata como desconexión.
+
+#define KEEPALIVE_DEFAULT   240   // Seconds idle before NOOP (!KEEPALIVE)
+#define KEEPALIVE_MIN       30
+#define KEEPALIVE_MAX       900   // * FRAMES_1S still fits in 16 bits
+#define KEEPALIVE_RETRY     5     // Seconds before re-probing after a miss
+
+static uint16_t keepalive_secs = KEEPALIVE_DEFAULT;   // 0 = off
+static uint16_t ka_since;                             // frames_now() at last activity
+static uint8_t  ka_missed;
+
+// Called from the main loop; key != 0 restarts the idle count
+static void keepalive_tick(uint8_t key)
+{
+    uint8_t disc;
+    
+    if (key || !keepalive_secs || connection_state < STATE_FTP_CONNECTED) {
+        ka_since = frames_now();
+        ka_missed = 0;
+        return;
+    }
+    if ((uint16_t)(frames_now() - ka_since) < keepalive_secs * FRAMES_1S) return;
+    
+    if (quick_noop_check(rtt_timeout(2 * FRAMES_1S))) {
+        ka_since = frames_now();
+        ka_missed = 0;
+        return;
+    }
+    
+    disc = check_disconnect_message();
+    if (disc || ++ka_missed >= 2) {
+        report_disconnect(disc ? disconnect_reason(disc) : "NOOP timeout");
+        return;
+    }
+    ka_since = frames_now() - (keepalive_secs - KEEPALIVE_RETRY) * FRAMES_1S;
+}
+
+static void cmd_keepalive(const char *arg)
+{
+    if (arg[0]) {
+        char *q = (char*)arg;
+        uint16_t n = parse_decimal(&q);
+        if (arg[0] < '0' || arg[0] > '9' || (n && (n < KEEPALIVE_MIN || n > KEEPALIVE_MAX))) {
+            fail("Usage: !KEEPALIVE [0|30-900]");
+            return;
+        }
+        keepalive_secs = n;
+    }
+    
+    current_attr = ATTR_RESPONSE;
+    if (!keepalive_secs) {
+        main_print("Keepalive: off");
+        return;
+    }
+    {
+        char *p = tx_buffer;
+        p = str_append(p, "Keepalive: NOOP after ");
+        p = u16_to_dec(p, keepalive_secs);
+        p = str_append(p, " s idle");
+    }
+    main_print(tx_buffer);
+}
+
 static void print_intro_banner(void)
 {
     // Texto blanco brillante sobre fondo negro
@@ -4715,8 +6984,10 @@ void main(void)
 {
     uint8_t c;
     uint8_t background_timer = 0;
+    uint8_t key_idle = KEY_IDLE_FRAMES;
 
     init_screen();
+    wb_ok = bank_detect();
     
     // 1. Banner inicial
     print_intro_banner();
@@ -4731,11 +7002,17 @@ void main(void)
     redraw_input_from(0);
     
     while (1) {
-        HALT(); // Sincronización 50Hz
+        rx_wait_frame(); // Sincronización 50Hz (sin HALT si hay socket abierto)
+        
+        // Ráfagas cortas mientras se teclea, normales en reposo
+        uart_drain_limit = (key_idle < KEY_IDLE_FRAMES) ? DRAIN_TYPING : DRAIN_NORMAL;
         
         // 1. Monitor de conexión SIEMPRE (crítico para detección de timeout)
         check_connection_alive();
         
+        // Ventana de ~5 s para vigilar errores de trama del UART
+        if (++background_timer == 0) uart_check_errors();
+        
         // 2. Detectar toggle de CAPS LOCK para actualizar cursor inmediatamente
         {
             static uint8_t prev_caps_mode = 0;
@@ -4768,8 +7045,15 @@ void main(void)
         // 4. UI updates
         ui_flush_dirty();
         
+        // Keepalive solo con el teclado en reposo
+        keepalive_tick(c);
+        
         // Si no hay tecla, vuelta rápida
-        if (c == 0) continue;
+        if (c == 0) {
+            if (key_idle < KEY_IDLE_FRAMES) key_idle++;
+            continue;
+        }
+        key_idle = 0;
         
         // --- PROCESAMIENTO DE TECLAS ---
         
@@ -4813,6 +7097,7 @@ void main(void)
                 
                 draw_status_bar();
                 set_input_busy(0);
+                keepalive_tick(c);  // El comando también cuenta como actividad
             }
         }
         else if (c >= 32 && c <= 126) {